@@ -0,0 +1,374 @@
+/* Copyright 2022 Oliver Giles
+ * This file is part of Wemed. Wemed is licensed under the
+ * GNU GPL version 3. See LICENSE or <http://www.gnu.org/licenses/>
+ * for more information */
+#include <string.h>
+#include "codec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CODEC_X86
+#include <immintrin.h>
+#endif
+
+// 57 bytes of input make a 76 character line
+#define LINE_INPUT 57
+#define LINE_OUTPUT 76
+
+static const char base64_alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// -1 for characters outside the alphabet
+static signed char base64_values[256];
+
+// The SIMD kernels convert whole blocks and return how much of the input
+// they used, leaving the remainder to the scalar code
+typedef size_t (*EncodeKernel)(const unsigned char* in, size_t len, char* out);
+typedef size_t (*DecodeKernel)(const char* in, size_t len, unsigned char* out);
+
+static size_t encode_kernel_none(const unsigned char* in, size_t len, char* out) {
+	return 0;
+}
+
+static size_t decode_kernel_none(const char* in, size_t len, unsigned char* out) {
+	return 0;
+}
+
+static EncodeKernel encode_kernel = encode_kernel_none;
+static DecodeKernel decode_kernel = decode_kernel_none;
+static const char* implementation = "scalar";
+
+#ifdef CODEC_X86
+
+// Encoding and decoding follow Wojciech Muła's pshufb based methods:
+// http://0x80.pl/articles/index.html#base64-algorithm-new
+
+__attribute__((target("ssse3")))
+static inline __m128i encode_lookup_ssse3(__m128i in) {
+	// gather the three bytes needed for each group of four sextets
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	const __m128i indices = _mm_or_si128(t1, t3);
+
+	// map each range of the alphabet onto its offset from the sextet value
+	__m128i reduced = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	const __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	reduced = _mm_or_si128(reduced, _mm_and_si128(upper, _mm_set1_epi8(13)));
+	const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	                                      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+	                                      '/' - 63, 'A', 0, 0);
+	return _mm_add_epi8(_mm_shuffle_epi8(offsets, reduced), indices);
+}
+
+__attribute__((target("ssse3")))
+static size_t encode_kernel_ssse3(const unsigned char* in, size_t len, char* out) {
+	size_t i = 0;
+	// each load reads 16 bytes but only uses 12
+	for(; len - i >= 16; i += 12, out += 16)
+		_mm_storeu_si128((__m128i*) out, encode_lookup_ssse3(_mm_loadu_si128((const __m128i*) &in[i])));
+	return i;
+}
+
+// Translates 16 characters to sextets. Returns FALSE if any is outside the
+// alphabet, so the block can be left to the scalar code
+__attribute__((target("ssse3")))
+static inline int decode_lookup_ssse3(__m128i in, __m128i* values) {
+	#define IN_RANGE(lo, hi) _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8((lo) - 1)), _mm_cmpgt_epi8(_mm_set1_epi8((hi) + 1), in))
+	const __m128i upper = IN_RANGE('A', 'Z');
+	const __m128i lower = IN_RANGE('a', 'z');
+	const __m128i digit = IN_RANGE('0', '9');
+	#undef IN_RANGE
+	const __m128i plus = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+	const __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+	const __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+	if(_mm_movemask_epi8(valid) != 0xffff)
+		return 0;
+	__m128i shift = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+	shift = _mm_or_si128(shift, _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+	shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+	shift = _mm_or_si128(shift, _mm_and_si128(plus, _mm_set1_epi8(62 - '+')));
+	shift = _mm_or_si128(shift, _mm_and_si128(slash, _mm_set1_epi8(63 - '/')));
+	*values = _mm_add_epi8(in, shift);
+	return 1;
+}
+
+// packs four sextets per 32 bits into three bytes, in the low 12 bytes
+__attribute__((target("ssse3")))
+static inline __m128i decode_pack_ssse3(__m128i values) {
+	const __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+	const __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(words, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static size_t decode_kernel_ssse3(const char* in, size_t len, unsigned char* out) {
+	size_t i = 0;
+	for(; len - i >= 16; i += 16, out += 12) {
+		__m128i values;
+		if(!decode_lookup_ssse3(_mm_loadu_si128((const __m128i*) &in[i]), &values))
+			break;
+		char packed[16];
+		_mm_storeu_si128((__m128i*) packed, decode_pack_ssse3(values));
+		memcpy(out, packed, 12);
+	}
+	return i;
+}
+
+// the AVX2 versions do the same in each 128 bit lane
+__attribute__((target("avx2")))
+static size_t encode_kernel_avx2(const unsigned char* in, size_t len, char* out) {
+	const __m256i shuffle = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+	                                        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+	const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	                                         '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+	                                         '/' - 63, 'A', 0, 0,
+	                                         'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	                                         '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+	                                         '/' - 63, 'A', 0, 0);
+	size_t i = 0;
+	// the second lane reads 16 bytes from 12 bytes in
+	for(; len - i >= 28; i += 24, out += 32) {
+		__m256i in256 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) &in[i])),
+		                                        _mm_loadu_si128((const __m128i*) &in[i + 12]), 1);
+		in256 = _mm256_shuffle_epi8(in256, shuffle);
+		const __m256i t0 = _mm256_and_si256(in256, _mm256_set1_epi32(0x0fc0fc00));
+		const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		const __m256i t2 = _mm256_and_si256(in256, _mm256_set1_epi32(0x003f03f0));
+		const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		const __m256i indices = _mm256_or_si256(t1, t3);
+		__m256i reduced = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		const __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+		reduced = _mm256_or_si256(reduced, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+		_mm256_storeu_si256((__m256i*) out, _mm256_add_epi8(_mm256_shuffle_epi8(offsets, reduced), indices));
+	}
+	return i + encode_kernel_ssse3(&in[i], len - i, out);
+}
+
+__attribute__((target("avx2")))
+static size_t decode_kernel_avx2(const char* in, size_t len, unsigned char* out) {
+	size_t i = 0;
+	for(; len - i >= 32; i += 32, out += 24) {
+		const __m256i in256 = _mm256_loadu_si256((const __m256i*) &in[i]);
+		#define IN_RANGE(lo, hi) _mm256_and_si256(_mm256_cmpgt_epi8(in256, _mm256_set1_epi8((lo) - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), in256))
+		const __m256i upper = IN_RANGE('A', 'Z');
+		const __m256i lower = IN_RANGE('a', 'z');
+		const __m256i digit = IN_RANGE('0', '9');
+		#undef IN_RANGE
+		const __m256i plus = _mm256_cmpeq_epi8(in256, _mm256_set1_epi8('+'));
+		const __m256i slash = _mm256_cmpeq_epi8(in256, _mm256_set1_epi8('/'));
+		const __m256i valid = _mm256_or_si256(_mm256_or_si256(upper, lower), _mm256_or_si256(digit, _mm256_or_si256(plus, slash)));
+		if(_mm256_movemask_epi8(valid) != -1)
+			break;
+		__m256i shift = _mm256_and_si256(upper, _mm256_set1_epi8(-'A'));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a')));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')));
+		const __m256i values = _mm256_add_epi8(in256, shift);
+		const __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+		const __m256i words = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+		const __m256i packed = _mm256_shuffle_epi8(words, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		                                                                   2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		char lanes[32];
+		_mm256_storeu_si256((__m256i*) lanes, packed);
+		memcpy(out, lanes, 12);
+		memcpy(&out[12], &lanes[16], 12);
+	}
+	return i + decode_kernel_ssse3(&in[i], len - i, out);
+}
+
+#endif
+
+__attribute__((constructor))
+static void codec_init(void) {
+	memset(base64_values, -1, sizeof(base64_values));
+	for(int i = 0; i < 64; ++i)
+		base64_values[(unsigned char) base64_alphabet[i]] = i;
+
+#ifdef CODEC_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		encode_kernel = encode_kernel_avx2;
+		decode_kernel = decode_kernel_avx2;
+		implementation = "avx2";
+	} else if(__builtin_cpu_supports("ssse3")) {
+		encode_kernel = encode_kernel_ssse3;
+		decode_kernel = decode_kernel_ssse3;
+		implementation = "ssse3";
+	}
+#endif
+}
+
+const char* codec_implementation(void) {
+	return implementation;
+}
+
+size_t codec_base64_encode_bound(size_t len) {
+	// the input may complete up to two bytes left over from the last step
+	size_t chars = (len + 2) / 3 * 4 + 4;
+	return chars + chars / LINE_OUTPUT + 2;
+}
+
+static inline void encode_triple(const unsigned char* in, char* out) {
+	out[0] = base64_alphabet[in[0] >> 2];
+	out[1] = base64_alphabet[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+	out[2] = base64_alphabet[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+	out[3] = base64_alphabet[in[2] & 0x3f];
+}
+
+size_t codec_base64_encode_step(const unsigned char* in, size_t len, char* out, struct Base64EncodeState* st) {
+	char* start = out;
+	while(len > 0) {
+		if(st->nrem == 0 && st->col == 0 && len >= LINE_INPUT) {
+			// a whole line at once
+			size_t done = encode_kernel(in, LINE_INPUT, out);
+			for(size_t i = done; i < LINE_INPUT; i += 3)
+				encode_triple(&in[i], &out[i / 3 * 4]);
+			out[LINE_OUTPUT] = '\n';
+			out += LINE_OUTPUT + 1;
+			in += LINE_INPUT;
+			len -= LINE_INPUT;
+			continue;
+		}
+		st->rem[st->nrem++] = *in++;
+		len--;
+		if(st->nrem == 3) {
+			encode_triple(st->rem, out);
+			out += 4;
+			st->nrem = 0;
+			st->col += 4;
+			if(st->col == LINE_OUTPUT) {
+				*out++ = '\n';
+				st->col = 0;
+			}
+		}
+	}
+	return out - start;
+}
+
+size_t codec_base64_encode_close(char* out, struct Base64EncodeState* st) {
+	char* start = out;
+	if(st->nrem > 0) {
+		unsigned char last[3] = {0, 0, 0};
+		memcpy(last, st->rem, st->nrem);
+		encode_triple(last, out);
+		if(st->nrem == 1)
+			out[2] = '=';
+		out[3] = '=';
+		out += 4;
+		st->col += 4;
+	}
+	if(st->col > 0)
+		*out++ = '\n';
+	st->nrem = 0;
+	st->col = 0;
+	return out - start;
+}
+
+static size_t decode_segment(const char* in, size_t len, unsigned char* out, struct Base64DecodeState* st) {
+	unsigned char* start = out;
+	size_t i = 0;
+	while(i < len) {
+		if(st->n == 0) {
+			size_t done = decode_kernel(&in[i], len - i, out);
+			i += done;
+			out += done / 4 * 3;
+			if(i == len)
+				break;
+		}
+		// one character at a time until the next quad boundary, or past
+		// a block the kernel couldn't handle
+		unsigned char c = in[i++];
+		int v = base64_values[c];
+		if(v >= 0) {
+			st->bits = (st->bits << 6) | v;
+			if(++st->n == 4) {
+				out[0] = st->bits >> 16;
+				out[1] = st->bits >> 8;
+				out[2] = st->bits;
+				out += 3;
+				st->n = 0;
+				st->bits = 0;
+			}
+		} else if(c == '=') {
+			// padding ends the quad early
+			if(st->n == 2) {
+				*out++ = st->bits >> 4;
+			} else if(st->n == 3) {
+				out[0] = st->bits >> 10;
+				out[1] = st->bits >> 2;
+				out += 2;
+			}
+			st->n = 0;
+			st->bits = 0;
+		}
+	}
+	return out - start;
+}
+
+size_t codec_base64_decode_bound(size_t len, const struct Base64DecodeState* st) {
+	// every four characters make at most three bytes, and padding closes
+	// a quad early with fewer
+	return (st->n + len) * 3 / 4;
+}
+
+size_t codec_base64_decode_step(const char* in, size_t len, unsigned char* out, struct Base64DecodeState* st) {
+	unsigned char* start = out;
+	const char* end = in + len;
+	// decode line by line so the kernels see runs of pure alphabet
+	while(in < end) {
+		const char* nl = memchr(in, '\n', end - in);
+		const char* line_end = nl ? nl : end;
+		size_t n = line_end - in;
+		if(n > 0 && in[n - 1] == '\r')
+			n--;
+		out += decode_segment(in, n, out, st);
+		in = nl ? nl + 1 : end;
+	}
+	return out - start;
+}
+
+static inline int hex_value(char c) {
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+size_t codec_qp_decode_step(const char* in, size_t len, unsigned char* out, size_t* consumed, int final) {
+	unsigned char* start = out;
+	size_t i = 0;
+	while(i < len) {
+		// most of the text is literal, so copy up to the next escape in one go
+		const char* eq = memchr(&in[i], '=', len - i);
+		size_t run = eq ? (size_t) (eq - &in[i]) : len - i;
+		memcpy(out, &in[i], run);
+		out += run;
+		i += run;
+		if(!eq)
+			break;
+
+		size_t left = len - i;
+		if(left >= 2 && in[i + 1] == '\n') {
+			i += 2; // soft line break
+		} else if(left >= 3 && in[i + 1] == '\r' && in[i + 2] == '\n') {
+			i += 3;
+		} else if(left >= 3 && hex_value(in[i + 1]) >= 0 && hex_value(in[i + 2]) >= 0) {
+			*out++ = hex_value(in[i + 1]) << 4 | hex_value(in[i + 2]);
+			i += 3;
+		} else if(left < 3 && !final && (left == 1 || in[i + 1] == '\r' || hex_value(in[i + 1]) >= 0)) {
+			break; // the rest of the sequence is in the next step
+		} else {
+			// not a valid escape, so pass it through
+			*out++ = '=';
+			i++;
+		}
+	}
+	*consumed = i;
+	return out - start;
+}
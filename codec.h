@@ -0,0 +1,50 @@
+#ifndef CODEC_H
+#define CODEC_H
+/* Copyright 2022 Oliver Giles
+ * This file is part of Wemed. Wemed is licensed under the
+ * GNU GPL version 3. See LICENSE or <http://www.gnu.org/licenses/>
+ * for more information */
+#include <stddef.h>
+
+// Streaming base64 and quoted-printable codecs for part content. The bulk
+// of the work is done with SSSE3 or AVX2 when the CPU supports it, chosen
+// at runtime, with a portable fallback.
+
+// States must be zero-initialised before the first step
+struct Base64EncodeState {
+	unsigned char rem[3];
+	int nrem;
+	int col; // output line length so far
+};
+
+struct Base64DecodeState {
+	unsigned int bits;
+	int n; // sextets in bits
+};
+
+// The most output codec_base64_encode_step and codec_base64_encode_close
+// together can produce from len bytes of input
+size_t codec_base64_encode_bound(size_t len);
+
+// Encodes in 76 character lines. Returns the number of bytes written to out
+size_t codec_base64_encode_step(const unsigned char* in, size_t len, char* out, struct Base64EncodeState* st);
+size_t codec_base64_encode_close(char* out, struct Base64EncodeState* st);
+
+// The most output codec_base64_decode_step can produce from len bytes of
+// input. Sextets left over in st from earlier input count too, so a single
+// byte of input can complete three bytes of output
+size_t codec_base64_decode_bound(size_t len, const struct Base64DecodeState* st);
+
+// Decodes, skipping line breaks and any other characters outside the
+// alphabet. Returns the number of bytes written to out
+size_t codec_base64_decode_step(const char* in, size_t len, unsigned char* out, struct Base64DecodeState* st);
+
+// Decodes quoted-printable. Output is never larger than the input. Unless
+// final is set, an escape sequence cut off at the end of the input is left
+// unconsumed; *consumed receives how much of the input was used
+size_t codec_qp_decode_step(const char* in, size_t len, unsigned char* out, size_t* consumed, int final);
+
+// The implementation selected for this CPU, for diagnostics
+const char* codec_implementation(void);
+
+#endif
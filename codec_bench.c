@@ -0,0 +1,141 @@
+/* Copyright 2022 Oliver Giles
+ * This file is part of Wemed. Wemed is licensed under the
+ * GNU GPL version 3. See LICENSE or <http://www.gnu.org/licenses/>
+ * for more information */
+#include <gmime/gmime.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "codec.h"
+#include "mimefilter.h"
+
+// Times wemed's filters against GMime's stock basic filter over the same
+// input, fed in chunks the size a GMimeStreamFilter would pass them on.
+// Usage: codec-bench [megabytes] [rounds]
+
+#define CHUNK 4096
+// decoding a byte at a time leaves every possible state carried between
+// reads; slow, so only done over the first part of the input
+#define TINY_CHUNK_INPUT (256 * 1024)
+
+struct Output {
+	char* data;
+	size_t len;
+};
+
+static void append(struct Output* o, const char* data, size_t len) {
+	memcpy(o->data + o->len, data, len);
+	o->len += len;
+}
+
+// Runs in through filter, chunk bytes at a time, returning the output in o
+// and the time taken in microseconds. o must be large enough for the whole
+// output
+static gint64 run_filter(GMimeFilter* filter, const char* in, size_t len, size_t chunk, struct Output* o) {
+	char* out;
+	size_t outlen, outprespace;
+	o->len = 0;
+	g_mime_filter_reset(filter);
+	gint64 start = g_get_monotonic_time();
+	size_t pos = 0;
+	while(len - pos > chunk) {
+		g_mime_filter_filter(filter, (char*) in + pos, chunk, 0, &out, &outlen, &outprespace);
+		append(o, out, outlen);
+		pos += chunk;
+	}
+	g_mime_filter_complete(filter, (char*) in + pos, len - pos, 0, &out, &outlen, &outprespace);
+	append(o, out, outlen);
+	return g_get_monotonic_time() - start;
+}
+
+// Runs both filters over in for the given number of rounds, keeping the
+// best time of each, and checks that they agree
+static int compare(const char* name, GMimeContentEncoding encoding, gboolean encode, const char* in, size_t len, size_t chunk, int rounds) {
+	GMimeFilter* stock = g_mime_filter_basic_new(encoding, encode);
+	GMimeFilter* ours = wemed_filter_basic_new(encoding, encode);
+	size_t cap = encode ? codec_base64_encode_bound(len) + len / 16 + 16 : len + 16;
+	struct Output a = { malloc(cap), 0 };
+	struct Output b = { malloc(cap), 0 };
+	gint64 best_stock = G_MAXINT64, best_ours = G_MAXINT64;
+	for(int i = 0; i < rounds; ++i) {
+		best_stock = MIN(best_stock, run_filter(stock, in, len, chunk, &a));
+		best_ours = MIN(best_ours, run_filter(ours, in, len, chunk, &b));
+	}
+	int same = a.len == b.len && memcmp(a.data, b.data, a.len) == 0;
+	double mb = len / (1024.0 * 1024.0);
+	printf("%-22s gmime %8.1f MB/s   wemed %8.1f MB/s   %5.2fx%s\n", name,
+		mb / (best_stock / 1e6), mb / (best_ours / 1e6), (double) best_stock / best_ours,
+		same ? "" : "   OUTPUT DIFFERS");
+	free(a.data);
+	free(b.data);
+	g_object_unref(stock);
+	g_object_unref(ours);
+	return same;
+}
+
+// How much of in to decode a byte at a time: whole lines, so that an
+// escape or quad isn't cut off at the end
+static size_t tiny_chunk_len(const char* in, size_t len) {
+	if(len <= TINY_CHUNK_INPUT)
+		return len;
+	const char* nl = memrchr(in, '\n', TINY_CHUNK_INPUT);
+	return nl ? (size_t) (nl - in) + 1 : len;
+}
+
+// Encodes in with GMime's stock filter to make input for the decoders
+static char* encode_with_gmime(GMimeContentEncoding encoding, const char* in, size_t len, size_t* outlen) {
+	GMimeFilter* filter = g_mime_filter_basic_new(encoding, TRUE);
+	// quoted-printable can triple the size of binary input, before the
+	// soft line breaks are added
+	struct Output o = { malloc(len * 4 + 16), 0 };
+	run_filter(filter, in, len, CHUNK, &o);
+	g_object_unref(filter);
+	*outlen = o.len;
+	return o.data;
+}
+
+int main(int argc, char** argv) {
+	size_t len = (argc > 1 ? strtoul(argv[1], NULL, 10) : 64) * 1024 * 1024;
+	int rounds = argc > 2 ? atoi(argv[2]) : 5;
+	if(len == 0 || rounds < 1) {
+		fprintf(stderr, "Usage: %s [megabytes] [rounds]\n", argv[0]);
+		return 1;
+	}
+	g_mime_init();
+	printf("codec implementation: %s, %zu MB, best of %d\n", codec_implementation(), len / (1024 * 1024), rounds);
+
+	// attachments are mostly already compressed, so random bytes stand in
+	// for them; text is mostly printable with the odd 8-bit character
+	char* binary = malloc(len);
+	char* text = malloc(len);
+	GRand* rand = g_rand_new_with_seed(1);
+	for(size_t i = 0; i < len; ++i) {
+		binary[i] = g_rand_int(rand);
+		guint32 r = g_rand_int_range(rand, 0, 100);
+		text[i] = r == 0 ? '\n' : r == 1 ? (char) 0xe9 : 'a' + r % 26;
+	}
+	g_rand_free(rand);
+
+	int ok = 1;
+	ok &= compare("base64 encode", GMIME_CONTENT_ENCODING_BASE64, TRUE, binary, len, CHUNK, rounds);
+
+	size_t enclen;
+	char* encoded = encode_with_gmime(GMIME_CONTENT_ENCODING_BASE64, binary, len, &enclen);
+	ok &= compare("base64 decode", GMIME_CONTENT_ENCODING_BASE64, FALSE, encoded, enclen, CHUNK, rounds);
+	ok &= compare("base64 decode (1 byte)", GMIME_CONTENT_ENCODING_BASE64, FALSE, encoded, tiny_chunk_len(encoded, enclen), 1, 1);
+	free(encoded);
+
+	encoded = encode_with_gmime(GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE, text, len, &enclen);
+	ok &= compare("qp decode (text)", GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE, FALSE, encoded, enclen, CHUNK, rounds);
+	free(encoded);
+
+	encoded = encode_with_gmime(GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE, binary, len, &enclen);
+	ok &= compare("qp decode (binary)", GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE, FALSE, encoded, enclen, CHUNK, rounds);
+	ok &= compare("qp decode (1 byte)", GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE, FALSE, encoded, tiny_chunk_len(encoded, enclen), 1, 1);
+	free(encoded);
+
+	free(binary);
+	free(text);
+	g_mime_shutdown();
+	return ok ? 0 : 1;
+}
@@ -2,35 +2,49 @@
  * This file is part of Wemed. Wemed is licensed under the
  * GNU GPL version 3. See LICENSE or <http://www.gnu.org/licenses/>
  * for more information */
-#include <sys/wait.h>
-#include <fcntl.h>
+#include <gio/gio.h>
 #include "exec.h"
 
-ssize_t exec_get(char* buffer, size_t nbuf, const char* file, const char* const* args) {
-	int pipes[2];
+struct ExecJob {
+	GSubprocess* proc;
+	GError* error;
+	ExecCallback callback;
+	gpointer user_data;
+};
 
-	pipe(pipes);
-	fcntl(pipes[1], F_SETFL, fcntl(pipes[1], F_GETFL) | O_NONBLOCK);
-	fcntl(pipes[0], F_SETFL, fcntl(pipes[0], F_GETFL) | O_NONBLOCK);
+static void exec_job_complete(struct ExecJob* job) {
+	int exit_status = -1;
+	if(job->proc && !job->error && g_subprocess_get_if_exited(job->proc))
+		exit_status = g_subprocess_get_exit_status(job->proc);
 
-	pid_t pid = fork();
-	if(pid == 0) { //child
-		dup2(pipes[1], STDOUT_FILENO);
-		close(pipes[0]);
-		close(pipes[1]);
-		execvp(file, (char*const*)args);
-		_exit(0);
-	}
-	waitpid(pid, 0, 0);
-	ssize_t n = read(pipes[0], buffer, nbuf);
-	if(n < 0)
-		return (int) n;
-	buffer[nbuf] = '\0';
+	job->callback(exit_status, job->error, job->user_data);
+
+	g_clear_error(&job->error);
+	g_clear_object(&job->proc);
+	g_free(job);
+}
 
-	close(pipes[0]);
-	close(pipes[1]);
+static void wait_cb(GObject* source, GAsyncResult* result, gpointer user_data) {
+	struct ExecJob* job = user_data;
+	g_subprocess_wait_finish(G_SUBPROCESS(source), result, &job->error);
+	exec_job_complete(job);
+}
 
-	return n;
+static gboolean spawn_failed_idle(gpointer user_data) {
+	struct ExecJob* job = user_data;
+	exec_job_complete(job);
+	return G_SOURCE_REMOVE;
 }
 
+void exec_spawn_async(const char* const* args, ExecCallback callback, gpointer user_data) {
+	struct ExecJob* job = g_new0(struct ExecJob, 1);
+	job->callback = callback;
+	job->user_data = user_data;
 
+	job->proc = g_subprocess_newv(args, G_SUBPROCESS_FLAGS_NONE, &job->error);
+	if(!job->proc) {
+		g_idle_add(spawn_failed_idle, job);
+		return;
+	}
+	g_subprocess_wait_async(job->proc, NULL, wait_cb, job);
+}
@@ -4,9 +4,17 @@
  * This file is part of Wemed. Wemed is licensed under the
  * GNU GPL version 3. See LICENSE or <http://www.gnu.org/licenses/>
  * for more information */
-#include <unistd.h>
+#include <gio/gio.h>
 
-ssize_t exec_get(char* buffer, size_t nbuf, const char* file, const char* const* args);
+// Called on the main loop once a process started by exec_spawn_async has
+// exited. exit_status is -1 unless the process exited normally. If the
+// process could not be started, error is set
+typedef void (*ExecCallback)(int exit_status, const GError* error, gpointer user_data);
 
-#endif
+// Launches args[0] from PATH without blocking the main loop, for running
+// applications such as editors and viewers. The process shares our stdin,
+// stdout and stderr, and runs for as long as it likes. The callback is
+// always invoked exactly once, and never before this function returns
+void exec_spawn_async(const char* const* args, ExecCallback callback, gpointer user_data);
 
+#endif
@@ -9,7 +9,9 @@
 #include <libintl.h>
 
 #include "mimemodel.h"
+#include "mimeapp.h"
 #include "mainwindow.h"
+#include "wemedpanel.h"
 
 int main(int argc, char** argv) {
 
@@ -18,6 +20,10 @@ int main(int argc, char** argv) {
 
 	gtk_init(&argc, &argv);
 	g_mime_init();
+	// get the web process going while the window is built and the
+	// document parsed
+	wemed_panel_prewarm();
+	mime_app_index_build();
 
 	WemedWindow* w = wemed_window_create();
 
@@ -5,6 +5,11 @@
 #include <gtk/gtk.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <gmime/gmime.h>
 #include <libintl.h>
 #define _(str) gettext(str)
@@ -14,6 +19,7 @@
 #include "mimetree.h"
 #include "mainwindow.h"
 #include "openwith.h"
+#include "exec.h"
 
 // these menu widgets are dynamically modified throughout
 // the program lifecycle, so references are saved here. Other
@@ -25,6 +31,7 @@ typedef struct {
 	GtkWidget* close;
 	GtkWidget* part;
 	GtkWidget* show_html_source;
+	GtkWidget* menu_part_view;
 	GtkWidget* menu_part_edit;
 	GtkWidget* menu_part_edit_with;
 	GtkWidget* menu_part_export;
@@ -45,8 +52,38 @@ struct _WemedWindow {
 	char* filename;
 	gboolean dirty;
 	struct Application mime_app;
+	// set while the content of current_part is being decoded
+	GCancellable* load_cancellable;
+	// set while the view's changes are being fetched into the model
+	struct RegisterJob* registering;
+	// parts left alone by register_changes because they weren't edited
+	guint reencodes_skipped;
+	// set while the document is being written or its parts exported
+	GCancellable* busy_cancellable;
+	GtkWidget* menubar;
+	GtkWidget* busy_bar;
+	GtkWidget* busy_progress;
+	// parts open in external applications
+	GList* edit_sessions;
+	// memfds holding parts shown in external viewers
+	GList* view_fds;
 };
 
+// Operations that need the model to reflect the view (saving, switching
+// parts...) run after register_changes completes. ok is FALSE if the
+// operation was abandoned
+typedef void (*WindowContinuation)(WemedWindow* w, gboolean ok, gpointer data);
+
+struct Continuation {
+	WindowContinuation fn;
+	gpointer data;
+};
+
+static void run_continuation(WemedWindow* w, WindowContinuation fn, gboolean ok, gpointer data) {
+	if(fn)
+		fn(w, ok, data);
+}
+
 static void update_title(WemedWindow* w) {
 	char* slashpos = strrchr(w->filename, '/');
 	char* basename = slashpos ? &slashpos[1] : w->filename;
@@ -61,31 +98,12 @@ static void expand_mime_tree_view(WemedWindow* w) {
 	gtk_paned_set_position(GTK_PANED(w->paned), p);
 }
 
-static GString slurp_and_close(FILE* fp) {
-	GString ret = {0, 0, 0};
-	if(fseek(fp, 0, SEEK_END) < 0)
-		return ret;
-
-	long n = ftell(fp);
-	if(n < 0) {
-		perror("ftell");
-		return ret;
-	}
-	ret.len = (gsize) n;
-	rewind(fp);
-	ret.str = malloc(ret.len);
-	fread(ret.str, 1, ret.len, fp);
-	fclose(fp);
-	return ret;
-}
-
 static void set_model(WemedWindow* w, MimeModel* m) {
 	gtk_tree_view_set_model(GTK_TREE_VIEW(w->mime_tree), mime_model_get_gtk_model(m));
 	g_signal_connect_swapped(m, "node-inserted", G_CALLBACK(mime_tree_node_inserted), w->mime_tree);
 	gtk_tree_view_expand_all(GTK_TREE_VIEW(w->mime_tree));
 
 	w->model = m;
-	g_signal_connect(G_OBJECT(w->panel), "cid-requested", G_CALLBACK(mime_model_object_from_cid), w->model);
 	gtk_widget_set_sensitive(w->mime_tree, TRUE);
 	gtk_widget_set_sensitive(w->menu_widgets->saveas, TRUE);
 	gtk_widget_set_sensitive(w->menu_widgets->close, TRUE);
@@ -93,9 +111,67 @@ static void set_model(WemedWindow* w, MimeModel* m) {
 	expand_mime_tree_view(w);
 }
 
+// state carried across the background decode of a selected part
+struct PendingLoad {
+	WemedWindow* w;
+	GMimeObject* part;
+	GCancellable* cancellable;
+	char* mime_type;
+	char* charset;
+};
+
+static void pending_load_free(struct PendingLoad* p) {
+	g_object_unref(p->part);
+	g_object_unref(p->cancellable);
+	free(p->mime_type);
+	g_free(p->charset);
+	g_free(p);
+}
+
+static void part_content_loaded(GObject* source, GAsyncResult* result, gpointer user_data) {
+	struct PendingLoad* p = user_data;
+	WemedWindow* w = p->w;
+	GError* err = NULL;
+	GBytes* content = mime_model_part_content_finish(w->model, result, &err);
+
+	// a newer selection has superseded this one
+	if(g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED) || p->cancellable != w->load_cancellable) {
+		g_clear_error(&err);
+		if(content)
+			g_bytes_unref(content);
+		pending_load_free(p);
+		return;
+	}
+	g_clear_object(&w->load_cancellable);
+	if(err) {
+		// showing the part as empty would hide that it couldn't be read
+		fprintf(stderr, "Could not decode part: %s\n", err->message);
+		g_error_free(err);
+		wemed_panel_clear(WEMED_PANEL(w->panel));
+		pending_load_free(p);
+		return;
+	}
+
+	GString headers = mime_model_part_headers(p->part);
+	WemedPanelDoc doc = { p->mime_type, p->charset, headers, content, w->mime_app.name };
+	wemed_panel_load_doc(WEMED_PANEL(w->panel), doc);
+	if(content)
+		g_bytes_unref(content);
+	g_free(headers.str);
+	pending_load_free(p);
+}
+
 // loads a new part into the panel. Triggered by a selection
-// change in the MIME tree view widget
+// change in the MIME tree view widget. The content of leaf parts
+// is decoded in the background so large parts don't block the UI
 static void set_current_part(WemedWindow* w, GMimeObject* part) {
+	gint64 start_time = g_get_monotonic_time();
+	// any decode still running is for a stale selection
+	if(w->load_cancellable) {
+		g_cancellable_cancel(w->load_cancellable);
+		g_clear_object(&w->load_cancellable);
+	}
+
 	w->current_part = part;
 	if(part == NULL)
 		return;
@@ -103,32 +179,34 @@ static void set_current_part(WemedWindow* w, GMimeObject* part) {
 	GString headers = mime_model_part_headers(part);
 	const char* charset = g_mime_object_get_content_type_parameter(part, "charset");
 	char* mime_type = mime_model_content_type(w->current_part);
-	GString content = {0, 0, 0};
 
 	gtk_widget_set_sensitive(w->menu_widgets->menu_part_delete, (part != mime_model_root(w->model)));
 
 	// enable the 'Part' menu
 	gtk_widget_set_sensitive(w->menu_widgets->part, TRUE);
 	if(GMIME_IS_MULTIPART(part)) {
+		gtk_widget_set_sensitive(w->menu_widgets->menu_part_view, FALSE);
 		gtk_widget_set_sensitive(w->menu_widgets->menu_part_edit, FALSE);
 		gtk_widget_set_sensitive(w->menu_widgets->menu_part_edit_with, FALSE);
 		gtk_widget_set_sensitive(w->menu_widgets->menu_part_export, FALSE);
+		WemedPanelDoc doc = { mime_type, charset, headers, NULL, w->mime_app.name };
+		wemed_panel_load_doc(WEMED_PANEL(w->panel), doc);
+		free(mime_type);
 	} else {
+		gboolean show_source = FALSE;
+		gtk_widget_set_sensitive(w->menu_widgets->menu_part_view, TRUE);
 		gtk_widget_set_sensitive(w->menu_widgets->menu_part_edit, TRUE);
 		gtk_widget_set_sensitive(w->menu_widgets->menu_part_edit_with, TRUE);
 		gtk_widget_set_sensitive(w->menu_widgets->menu_part_export, TRUE);
 		// if we're displaying html, respect the "view source" menu option
 		if(strcmp(mime_type, "text/html") == 0) {
 			gtk_widget_set_sensitive(w->menu_widgets->show_html_source, TRUE);
-			gboolean show_source = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(w->menu_widgets->show_html_source));
+			show_source = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(w->menu_widgets->show_html_source));
 			wemed_panel_show_source(WEMED_PANEL(w->panel), show_source);
 		} else {
 			gtk_widget_set_sensitive(w->menu_widgets->show_html_source, FALSE);
 			wemed_panel_show_source(WEMED_PANEL(w->panel), FALSE);
 		}
-		
-		// fetch the part content
-		content = mime_model_part_content(part);
 
 		// determine the external program for the given mime type and update the menu accordingly
 		free(w->mime_app.name); // clean up the last one
@@ -139,17 +217,35 @@ static void set_current_part(WemedWindow* w, GMimeObject* part) {
 			asprintf(&label, _("Edit with %s"), w->mime_app.name);
 			gtk_menu_item_set_label(GTK_MENU_ITEM(w->menu_widgets->menu_part_edit), label);
 			free(label);
+			asprintf(&label, _("View with %s"), w->mime_app.name);
+			gtk_menu_item_set_label(GTK_MENU_ITEM(w->menu_widgets->menu_part_view), label);
+			free(label);
 			gtk_widget_set_sensitive(w->menu_widgets->menu_part_edit, TRUE);
+			gtk_widget_set_sensitive(w->menu_widgets->menu_part_view, TRUE);
 		} else {
 			gtk_widget_set_sensitive(w->menu_widgets->menu_part_edit, FALSE);
+			gtk_widget_set_sensitive(w->menu_widgets->menu_part_view, FALSE);
 		}
-	}
 
-	WemedPanelDoc doc = { mime_type, charset, headers, content, w->mime_app.name };
-	wemed_panel_load_doc(WEMED_PANEL(w->panel), doc);
-	g_free(content.str);
+		// text shown in the source view has to be converted to utf-8, which
+		// can be done on the worker along with the decoding. WebKit handles
+		// the charset of HTML itself
+		gboolean source_view = strncmp(mime_type, "text/", 5) == 0 && (strcmp(mime_type, "text/html") != 0 || show_source);
+		const char* convert_from = (source_view && charset && strcasecmp(charset, "utf-8") != 0) ? charset : NULL;
+
+		struct PendingLoad* p = g_new0(struct PendingLoad, 1);
+		p->w = w;
+		p->part = g_object_ref(part);
+		p->cancellable = g_cancellable_new();
+		p->mime_type = mime_type;
+		p->charset = g_strdup(convert_from ? "utf-8" : charset);
+		w->load_cancellable = g_object_ref(p->cancellable);
+
+		wemed_panel_show_loading(WEMED_PANEL(w->panel), headers);
+		mime_model_part_content_async(w->model, part, convert_from, p->cancellable, part_content_loaded, p);
+	}
 	g_free(headers.str);
-	free(mime_type);
+	g_debug("part selection handled in %" G_GINT64_FORMAT "us", g_get_monotonic_time() - start_time);
 }
 
 static void set_dirtied(GObject* caller, WemedWindow* w) {
@@ -159,49 +255,152 @@ static void set_dirtied(GObject* caller, WemedWindow* w) {
 	gtk_widget_set_sensitive(w->menu_widgets->save, TRUE);
 }
 
-// update the internal model based on the changes the user has made in the view.
-// this involves fetching header and content data from the view and needs to be
-// called before the user changes to a different part or performs any model manipulations
-static void register_changes(WemedWindow* w) {
-	if(w->current_part == NULL || w->dirty == FALSE) return;
-	// first see if the content has been changed. Only do this for
-	// content types of text/ since other types can only be edited
-	// externally, at which time they get saved
-	if(GMIME_IS_PART(w->current_part)) {
-		char* ct = mime_model_content_type(w->current_part);
-		if(strncmp(ct, "text/", 5) == 0) {
-			// webkit returns content in utf-8, so we have to convert it back
-			// if the desired encoding is different
-			GString new_content = wemed_panel_get_content(WEMED_PANEL(w->panel));
-			const char* charset = g_mime_object_get_content_type_parameter(w->current_part, "charset");
-			if(charset && strcasecmp("utf-8", charset) != 0) {
-				gsize sz;
-				char* converted = g_convert(new_content.str, new_content.len, charset, "utf-8", NULL, &sz, NULL);
-				if(converted) {
-					free(new_content.str);
-					new_content.str = converted;
-					new_content.len = sz;
-				} else
-					fprintf(stderr, "Conversion failed\n");
-			}
-			mime_model_update_content(w->model, GMIME_PART(w->current_part), new_content);
-			free(new_content.str);
-		}
-		free(ct);
-	}
+// state carried across fetching the edited content back from the panel
+struct RegisterJob {
+	WemedWindow* w;
+	MimeModel* model;
+	GMimeObject* part;
+	GString headers;
+	gboolean headers_modified;
+	GList* continuations; // struct Continuation*, run in order once done
+};
 
-	// now do the headers
-	GString new_headers = wemed_panel_get_headers(WEMED_PANEL(w->panel));
+static void register_headers(WemedWindow* w, GString new_headers) {
 	if(strcmp(new_headers.str,g_mime_object_get_headers(w->current_part, g_mime_format_options_get_default())) != 0) {
 		set_dirtied(NULL, w);
 		GMimeObject* new_part = mime_model_update_header(w->model, w->current_part, new_headers);
 		if(new_part == NULL)
 			fprintf(stderr, "new_part is NULL\n");
+		else
+			w->current_part = new_part;
+	}
+}
+
+static void register_content(WemedWindow* w, GString new_content) {
+	// webkit returns content in utf-8, so we have to convert it back
+	// if the desired encoding is different
+	const char* charset = g_mime_object_get_content_type_parameter(w->current_part, "charset");
+	if(charset && strcasecmp("utf-8", charset) != 0) {
+		gsize sz;
+		char* converted = g_convert(new_content.str, new_content.len, charset, "utf-8", NULL, &sz, NULL);
+		if(converted) {
+			g_free(new_content.str);
+			new_content.str = converted;
+			new_content.len = sz;
+		} else
+			fprintf(stderr, "Conversion failed\n");
 	}
-	free(new_headers.str);
+	mime_model_update_content(w->model, GMIME_PART(w->current_part), new_content);
+	g_free(new_content.str);
 }
 
+static void register_content_fetched(GObject* source, GAsyncResult* result, gpointer user_data) {
+	struct RegisterJob* job = user_data;
+	WemedWindow* w = job->w;
+	GError* err = NULL;
+	GString new_content = wemed_panel_get_content_finish(WEMED_PANEL(source), result, &err);
+
+	// the document may have been closed or the part deleted in the meantime
+	gboolean ok = (w->model == job->model && w->current_part == job->part);
+	if(ok) {
+		if(new_content.str)
+			register_content(w, new_content);
+		else
+			fprintf(stderr, "Failed to fetch content: %s\n", err->message);
+		if(job->headers_modified)
+			register_headers(w, job->headers);
+	} else {
+		g_free(new_content.str);
+	}
+	g_clear_error(&err);
+
+	w->registering = NULL;
+	for(GList* l = job->continuations; l; l = l->next) {
+		struct Continuation* c = l->data;
+		run_continuation(w, c->fn, ok, c->data);
+		g_free(c);
+	}
+	g_list_free(job->continuations);
+	g_object_unref(job->part);
+	free(job->headers.str);
+	g_free(job);
+}
+
+// update the internal model based on the changes the user has made in the view,
+// then call next. This involves fetching header and content data from the view and
+// needs to be done before the user changes to a different part or performs any model
+// manipulations. Fetching HTML content is asynchronous, so next may run later
+static void register_changes(WemedWindow* w, WindowContinuation next, gpointer data) {
+	// a fetch already in progress will bring the model up to date
+	if(w->registering) {
+		struct Continuation* c = g_new(struct Continuation, 1);
+		c->fn = next;
+		c->data = data;
+		w->registering->continuations = g_list_append(w->registering->continuations, c);
+		return;
+	}
+	// nothing can have been edited while the part is still loading
+	if(w->current_part == NULL || w->dirty == FALSE || w->load_cancellable) {
+		run_continuation(w, next, TRUE, data);
+		return;
+	}
+
+	// the document being dirty doesn't mean this part is, and parts that
+	// are merely clicked through don't need to be fetched and re-encoded
+	gboolean content_modified = wemed_panel_content_modified(WEMED_PANEL(w->panel));
+	gboolean headers_modified = wemed_panel_headers_modified(WEMED_PANEL(w->panel));
+	if(!content_modified && !headers_modified) {
+		w->reencodes_skipped++;
+		g_debug("unmodified part not re-encoded (%u so far)", w->reencodes_skipped);
+		run_continuation(w, next, TRUE, data);
+		return;
+	}
+	// edits made from here on will be picked up next time
+	wemed_panel_set_clean(WEMED_PANEL(w->panel));
+
+	// headers can be read straight away, but are applied after the
+	// content so that they describe it
+	GString new_headers = wemed_panel_get_headers(WEMED_PANEL(w->panel));
+
+	// first see if the content has been changed. Only do this for
+	// content types of text/ since other types can only be edited
+	// externally, at which time they get saved
+	gboolean text = FALSE;
+	if(content_modified && GMIME_IS_PART(w->current_part)) {
+		char* ct = mime_model_content_type(w->current_part);
+		text = strncmp(ct, "text/", 5) == 0;
+		free(ct);
+	}
+	if(!text) {
+		if(headers_modified)
+			register_headers(w, new_headers);
+		free(new_headers.str);
+		run_continuation(w, next, TRUE, data);
+		return;
+	}
+
+	struct RegisterJob* job = g_new0(struct RegisterJob, 1);
+	job->w = w;
+	job->model = w->model;
+	job->part = g_object_ref(w->current_part);
+	job->headers = new_headers;
+	job->headers_modified = headers_modified;
+	struct Continuation* c = g_new(struct Continuation, 1);
+	c->fn = next;
+	c->data = data;
+	job->continuations = g_list_append(NULL, c);
+	w->registering = job;
+	wemed_panel_get_content_async(WEMED_PANEL(w->panel), NULL, register_content_fetched, job);
+}
+
+static void end_edit_sessions(WemedWindow* w);
+
 static void close_document(WemedWindow* w) {
+	end_edit_sessions(w);
+	if(w->load_cancellable) {
+		g_cancellable_cancel(w->load_cancellable);
+		g_clear_object(&w->load_cancellable);
+	}
 	wemed_panel_clear(WEMED_PANEL(w->panel));
 	gtk_tree_view_set_model(GTK_TREE_VIEW(w->mime_tree), NULL);
 	mime_model_free(w->model);
@@ -218,44 +417,374 @@ static void close_document(WemedWindow* w) {
 	gtk_widget_set_sensitive(w->menu_widgets->part, FALSE);
 }
 
+static void select_part_registered(WemedWindow* w, gboolean ok, gpointer data) {
+	GMimeObject* obj = data;
+	// the part may have been removed while the changes were registered
+	if(w->model && (obj == NULL || mime_model_contains(w->model, obj)))
+		set_current_part(w, obj);
+	if(obj)
+		g_object_unref(obj);
+}
+
 static void tree_selection_changed(MimeTree* tree, GMimeObject* obj, WemedWindow* w) {
-	register_changes(w);
-	set_current_part(w, obj);
+	register_changes(w, select_part_registered, obj ? g_object_ref(obj) : NULL);
+}
+
+// An external application editing a part through a temporary file. The
+// file is watched so that each save in the application updates the part.
+// Many launchers return before the editor they start does, so the file
+// is watched until the document is closed rather than until the process
+// exits
+struct EditSession {
+	WemedWindow* w;
+	GMimePart* part;
+	char* path;
+	GFileMonitor* monitor;
+	// held by the window's list, the running process and any check
+	guint refs;
+	gboolean ended;
+	// what the file looked like when last examined
+	goffset size;
+	gint64 mtime;
+	char* hash;
+	gboolean checking;
+	gboolean recheck;
+	guint retry_source;
+};
+
+// task data for a check of the file on a worker thread
+struct EditCheck {
+	char* path;
+	goffset size;
+	gint64 mtime;
+	gboolean changed;
+	GBytes* content;
+	char* hash;
+};
+
+static struct EditSession* edit_session_ref(struct EditSession* s) {
+	s->refs++;
+	return s;
+}
+
+static void edit_session_unref(struct EditSession* s) {
+	if(--s->refs > 0)
+		return;
+	g_object_unref(s->part);
+	g_free(s->path);
+	g_free(s->hash);
+	g_free(s);
+}
+
+static void edit_check_free(struct EditCheck* c) {
+	g_free(c->path);
+	if(c->content)
+		g_bytes_unref(c->content);
+	g_free(c->hash);
+	g_free(c);
+}
+
+static void end_edit_session(struct EditSession* s) {
+	if(s->ended)
+		return;
+	s->ended = TRUE;
+	s->w->edit_sessions = g_list_remove(s->w->edit_sessions, s);
+	if(s->monitor) {
+		g_file_monitor_cancel(s->monitor);
+		g_object_unref(s->monitor);
+	}
+	if(s->retry_source)
+		g_source_remove(s->retry_source);
+	unlink(s->path);
+	edit_session_unref(s);
+}
+
+static void end_edit_sessions(WemedWindow* w) {
+	while(w->edit_sessions)
+		end_edit_session(w->edit_sessions->data);
+	for(GList* l = w->view_fds; l; l = l->next)
+		close(GPOINTER_TO_INT(l->data));
+	g_list_free(w->view_fds);
+	w->view_fds = NULL;
+}
+
+static void check_edited_file_thread(GTask* task, gpointer source_object, gpointer task_data, GCancellable* cancellable) {
+	struct EditCheck* c = task_data;
+	struct stat st;
+	int fd = open(c->path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0 || fstat(fd, &st) != 0) {
+		int err = errno;
+		if(fd >= 0)
+			close(fd);
+		g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(err), "%s", g_strerror(err));
+		return;
+	}
+	gint64 mtime = (gint64) st.st_mtim.tv_sec * G_USEC_PER_SEC + st.st_mtim.tv_nsec / 1000;
+	if(st.st_size == c->size && mtime == c->mtime) {
+		close(fd);
+		g_task_return_boolean(task, TRUE);
+		return;
+	}
+	// read rather than mapped: editors may truncate and rewrite the file
+	// in place, and touching a mapped page past the new end would fault.
+	// The spare byte lets the end of the file be seen without growing
+	gsize cap = st.st_size + 1, len = 0;
+	guchar* data = g_malloc(cap);
+	for(;;) {
+		if(len == cap) {
+			// the file grew since it was examined
+			cap *= 2;
+			data = g_realloc(data, cap);
+		}
+		ssize_t n = pread(fd, data + len, cap - len, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0) {
+			int err = errno;
+			close(fd);
+			g_free(data);
+			g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(err), "%s", g_strerror(err));
+			return;
+		}
+		if(n == 0)
+			break;
+		len += n;
+	}
+	close(fd);
+	c->size = st.st_size;
+	c->mtime = mtime;
+	c->changed = TRUE;
+	c->hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256, data, len);
+	c->content = g_bytes_new_take(data, len);
+	g_task_return_boolean(task, TRUE);
+}
+
+static void check_edited_file(struct EditSession* s);
+
+static gboolean retry_check(gpointer user_data) {
+	struct EditSession* s = user_data;
+	s->retry_source = 0;
+	check_edited_file(s);
+	return G_SOURCE_REMOVE;
+}
+
+// Replaces the part's content with what the application saved
+static gboolean import_edited_file(struct EditSession* s, GBytes* content) {
+	WemedWindow* w = s->w;
+	if(w->busy_cancellable) {
+		// the document is being saved; try again afterwards. A retry may
+		// already be pending from an earlier check
+		if(!s->retry_source)
+			s->retry_source = g_timeout_add(500, retry_check, s);
+		return FALSE;
+	}
+	gsize len;
+	GString new_content = {0};
+	new_content.str = (char*) g_bytes_get_data(content, &len);
+	new_content.len = len;
+	set_dirtied(NULL, w);
+	mime_model_update_content(w->model, s->part, new_content);
+	if(w->current_part == GMIME_OBJECT(s->part))
+		set_current_part(w, GMIME_OBJECT(s->part));
+	return TRUE;
+}
+
+static void edited_file_checked(GObject* source_object, GAsyncResult* result, gpointer user_data) {
+	struct EditSession* s = user_data;
+	struct EditCheck* c = g_task_get_task_data(G_TASK(result));
+	GError* err = NULL;
+	s->checking = FALSE;
+	if(s->ended) {
+		// nothing to do
+	} else if(!g_task_propagate_boolean(G_TASK(result), &err)) {
+		// the application may have deleted the file and not yet replaced it
+		if(!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+			fprintf(stderr, "Could not read %s: %s\n", s->path, err->message);
+		g_error_free(err);
+	} else if(!mime_model_contains(s->w->model, GMIME_OBJECT(s->part))) {
+		// the part was deleted or replaced
+		end_edit_session(s);
+	} else if(c->changed) {
+		// rewriting the file without changing it (or touching it) doesn't
+		// count as an edit. The first check only takes a baseline
+		gboolean same = s->hash == NULL || strcmp(s->hash, c->hash) == 0;
+		if(same || import_edited_file(s, c->content)) {
+			s->size = c->size;
+			s->mtime = c->mtime;
+			g_free(s->hash);
+			s->hash = g_strdup(c->hash);
+		}
+	}
+	if(s->recheck && !s->ended) {
+		s->recheck = FALSE;
+		check_edited_file(s);
+	}
+	edit_session_unref(s);
+}
+
+static void check_edited_file(struct EditSession* s) {
+	if(s->checking) {
+		s->recheck = TRUE;
+		return;
+	}
+	s->checking = TRUE;
+	struct EditCheck* c = g_new0(struct EditCheck, 1);
+	c->path = g_strdup(s->path);
+	c->size = s->size;
+	c->mtime = s->mtime;
+	GTask* task = g_task_new(NULL, NULL, edited_file_checked, edit_session_ref(s));
+	g_task_set_task_data(task, c, (GDestroyNotify) edit_check_free);
+	g_task_run_in_thread(task, check_edited_file_thread);
+	g_object_unref(task);
+}
+
+static void edited_file_changed(GFileMonitor* monitor, GFile* file, GFile* other_file, GFileMonitorEvent event, struct EditSession* s) {
+	// editors often save by writing a new file and renaming it over the old
+	if(event == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT || event == G_FILE_MONITOR_EVENT_CREATED || event == G_FILE_MONITOR_EVENT_MOVED_IN || event == G_FILE_MONITOR_EVENT_RENAMED)
+		check_edited_file(s);
+}
+
+static void editor_exited(int exit_status, const GError* error, gpointer user_data) {
+	struct EditSession* s = user_data;
+	if(!s->ended) {
+		if(error) {
+			fprintf(stderr, "Could not run editor: %s\n", error->message);
+			end_edit_session(s);
+		} else {
+			// in case the file monitor missed the last save
+			check_edited_file(s);
+		}
+	}
+	edit_session_unref(s);
+}
+
+// Builds the command line from a desktop entry Exec value, passing file
+// in place of its file or URL field code, or after the arguments if it
+// has none. Other field codes are dropped
+static char** editor_argv(const char* exec, const char* file) {
+	int argc;
+	char** argv;
+	GError* err = NULL;
+	if(!g_shell_parse_argv(exec, &argc, &argv, &err)) {
+		fprintf(stderr, "Could not parse command %s: %s\n", exec, err->message);
+		g_error_free(err);
+		return NULL;
+	}
+	GPtrArray* args = g_ptr_array_new();
+	gboolean substituted = FALSE;
+	for(int i = 0; i < argc; ++i) {
+		if(argv[i][0] == '%' && argv[i][1] && !argv[i][2]) {
+			if(strchr("fFuUs", argv[i][1]) && !substituted) {
+				g_ptr_array_add(args, g_strdup(file));
+				substituted = TRUE;
+			} else if(argv[i][1] == '%') {
+				g_ptr_array_add(args, g_strdup("%"));
+			}
+			g_free(argv[i]);
+		} else {
+			g_ptr_array_add(args, argv[i]);
+		}
+	}
+	g_free(argv);
+	if(!substituted)
+		g_ptr_array_add(args, g_strdup(file));
+	g_ptr_array_add(args, NULL);
+	return (char**) g_ptr_array_free(args, FALSE);
+}
+
+// Where to put decoded copies of parts for other applications. The user's
+// runtime directory is private and in memory, so attachments aren't left
+// on disk
+static const char* private_tmp_dir(void) {
+	const char* dir = g_getenv("XDG_RUNTIME_DIR");
+	return (dir && g_file_test(dir, G_FILE_TEST_IS_DIR)) ? dir : g_get_tmp_dir();
 }
 
 static void open_part_with_external_app(WemedWindow* w, GMimePart* part, const char* app) {
-	char* tmpfile = strdup("/tmp/wemed-tmpfile-XXXXXX");
+	char* tmpfile = g_build_filename(private_tmp_dir(), "wemed-tmpfile-XXXXXX", NULL);
 	int fd = mkstemp(tmpfile);
-	FILE* fp = fdopen(fd, "wb");
-	mime_model_write_part(part, fp);
-	char* buffer = malloc(strlen(app) + strlen(tmpfile) + 5);
-	char* p = 0;
-	// TODO: improve this hack
-	// The external application to execute is taken from FreeDesktop Exec key:
-	// https://specifications.freedesktop.org/desktop-entry-spec/desktop-entry-spec-latest.html#exec-variables
-	if((p = strstr(app, "%f")) || (p = strstr(app, "%U")) || (p = strstr(app, "%s"))) {
-		p[1] = 's';
-		sprintf(buffer, app, tmpfile);
-	} else {
-		sprintf(buffer, "%s %s", app, tmpfile);
+	FILE* fp = fd < 0 ? NULL : fdopen(fd, "wb");
+	if(fp == NULL) {
+		fprintf(stderr, "Could not create %s: %s\n", tmpfile, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		g_free(tmpfile);
+		return;
 	}
-	close(fd);
-	system(buffer);
-	free(buffer);
-	// now we've come back from the external program, read the data back in and save it
-	// TODO: only if it has changed
-	GString new_content = slurp_and_close(fopen(tmpfile, "rb"));
-	unlink(tmpfile); // be a tidy kiwi
-
-	if(new_content.str) {
-		set_dirtied(NULL, w);
-		mime_model_update_content(w->model, part, new_content);
-		set_current_part(w, GMIME_OBJECT(part));
-		free(new_content.str);
-	} else {
-		fprintf(stderr, "failed to slurp %s\n", tmpfile);
+	gboolean written = mime_model_write_part(part, fp);
+	if(fclose(fp) != 0 || !written) {
+		fprintf(stderr, "Could not write %s\n", tmpfile);
+		unlink(tmpfile);
+		g_free(tmpfile);
+		return;
 	}
-	free(tmpfile);
+	char** argv = editor_argv(app, tmpfile);
+	if(argv == NULL) {
+		unlink(tmpfile);
+		g_free(tmpfile);
+		return;
+	}
+
+	struct EditSession* s = g_new0(struct EditSession, 1);
+	s->w = w;
+	s->part = g_object_ref(part);
+	s->path = tmpfile;
+	s->size = -1;
+	s->refs = 1;
+	GFile* file = g_file_new_for_path(tmpfile);
+	s->monitor = g_file_monitor_file(file, G_FILE_MONITOR_WATCH_MOVES, NULL, NULL);
+	g_object_unref(file);
+	if(s->monitor)
+		g_signal_connect(s->monitor, "changed", G_CALLBACK(edited_file_changed), s);
+	w->edit_sessions = g_list_prepend(w->edit_sessions, s);
+	// record what was written, so that only real edits are imported
+	check_edited_file(s);
+	exec_spawn_async((const char* const*) argv, editor_exited, edit_session_ref(s));
+	g_strfreev(argv);
+}
+
+static void viewer_exited(int exit_status, const GError* error, gpointer user_data) {
+	if(error)
+		fprintf(stderr, "Could not run viewer: %s\n", error->message);
+}
+
+// Shows a part in an external application without writing it to a file.
+// The decoded content is put in a sealed memfd which the application
+// opens through /proc. Like edit sessions, it is kept until the document
+// is closed. Falls back to editing through a temporary file if memfds
+// aren't available
+static void view_part_in_external_app(WemedWindow* w, GMimePart* part, const char* app) {
+	int fd = memfd_create("wemed-part", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(fd < 0) {
+		open_part_with_external_app(w, part, app);
+		return;
+	}
+	int wfd = dup(fd);
+	FILE* fp = wfd < 0 ? NULL : fdopen(wfd, "wb");
+	gboolean written = fp && mime_model_write_part(part, fp);
+	if(fp == NULL && wfd >= 0)
+		close(wfd);
+	if((fp && fclose(fp) != 0) || !written) {
+		fprintf(stderr, "Could not write part to memfd: %s\n", strerror(errno));
+		close(fd);
+		return;
+	}
+	// the viewer gets it read-only
+	if(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+		fprintf(stderr, "Could not seal memfd: %s\n", strerror(errno));
+
+	// /proc/self would refer to the viewer, or to whatever process it
+	// hands the file on to
+	char* path = g_strdup_printf("/proc/%d/fd/%d", (int) getpid(), fd);
+	char** argv = editor_argv(app, path);
+	g_free(path);
+	if(argv == NULL) {
+		close(fd);
+		return;
+	}
+	w->view_fds = g_list_prepend(w->view_fds, GINT_TO_POINTER(fd));
+	exec_spawn_async((const char* const*) argv, viewer_exited, NULL);
+	g_strfreev(argv);
 }
 
 static void set_clean(WemedWindow* w) {
@@ -268,49 +797,203 @@ static void set_clean(WemedWindow* w) {
 
 //>>>>>>>>>> BEGIN MENU BAR CALLBACK SECTION
 
-static gboolean menu_file_save_as(GtkMenuItem* item, WemedWindow* w) {
+struct SaveJob {
+	WemedWindow* w;
+	char* filename; // NULL to save over the current file
+	WindowContinuation next;
+	gpointer data;
+	// the document is written to tmpname on a worker thread, which owns fp
+	MimeModel* model;
+	char* target;
+	char* tmpname;
+	int fd;
+	FILE* fp;
+	gint64 estimate; // expected size, or 0 if unknown
+	// a duplicate of fd for the main thread to watch the file grow, since
+	// the worker closes fd when it is done
+	int progress_fd;
+	guint progress_source;
+};
 
-	GtkWidget *dialog = gtk_file_chooser_dialog_new (_("Save File"), GTK_WINDOW(w->root_window), GTK_FILE_CHOOSER_ACTION_SAVE, _("_Cancel"), GTK_RESPONSE_CANCEL, _("_Save"), GTK_RESPONSE_ACCEPT, NULL);
-	gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
-	if(w->filename)
-		gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), w->filename);
+static void save_job_free(struct SaveJob* job) {
+	free(job->filename);
+	g_free(job->target);
+	g_free(job->tmpname);
+	g_free(job);
+}
 
-	gboolean ret = FALSE;
-	if(gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
-		char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER (dialog));
-		FILE* fp = fopen(filename, "wb");
-		register_changes(w);
-		if(fp && mime_model_write_to_file(w->model, fp)) {
-			set_clean(w);
+// The document may be mapped from the file being replaced, and unmodified
+// parts are read from that mapping while writing. Truncating it in place
+// would pull the data out from under the writer, and a crash part way
+// through would lose the original, so the new version is written alongside
+// and renamed over the original once it is safely on disk
+static void write_document_thread(GTask* task, gpointer source_object, gpointer task_data, GCancellable* cancellable) {
+	struct SaveJob* job = task_data;
+	gboolean ok = mime_model_write_to_file(job->model, job->fp, cancellable);
+	if(ok && fflush(job->fp) != 0)
+		ok = FALSE;
+	if(ok && fsync(job->fd) != 0)
+		ok = FALSE;
+	if(fclose(job->fp) != 0)
+		ok = FALSE;
+	job->fp = NULL;
+	if(ok && !g_cancellable_is_cancelled(cancellable) && rename(job->tmpname, job->target) == 0) {
+		g_task_return_boolean(task, TRUE);
+		return;
+	}
+	int err = errno;
+	unlink(job->tmpname);
+	if(!g_task_return_error_if_cancelled(task))
+		g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(err), "%s", g_strerror(err));
+}
+
+static gboolean save_progress(gpointer user_data) {
+	struct SaveJob* job = user_data;
+	WemedWindow* w = job->w;
+	struct stat st;
+	if(job->progress_fd >= 0 && fstat(job->progress_fd, &st) == 0)
+		gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(w->busy_progress), MIN(1.0, (double) st.st_size / job->estimate));
+	else
+		gtk_progress_bar_pulse(GTK_PROGRESS_BAR(w->busy_progress));
+	return G_SOURCE_CONTINUE;
+}
+
+// the model must not change while it is being written (or exported), so
+// the window only offers cancelling the operation until it is done
+static void cancel_busy(WemedWindow* w) {
+	if(w->busy_cancellable)
+		g_cancellable_cancel(w->busy_cancellable);
+}
+
+static void set_busy(WemedWindow* w, GCancellable* cancellable, const char* what) {
+	g_clear_object(&w->busy_cancellable);
+	if(cancellable)
+		w->busy_cancellable = g_object_ref(cancellable);
+	gtk_widget_set_sensitive(w->menubar, cancellable == NULL);
+	gtk_widget_set_sensitive(w->paned, cancellable == NULL);
+	gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(w->busy_progress), 0);
+	if(what)
+		gtk_progress_bar_set_text(GTK_PROGRESS_BAR(w->busy_progress), what);
+	gtk_widget_set_visible(w->busy_bar, cancellable != NULL);
+}
+
+static void document_written(GObject* source, GAsyncResult* result, gpointer user_data) {
+	struct SaveJob* job = user_data;
+	WemedWindow* w = job->w;
+	GError* err = NULL;
+	gboolean ok = g_task_propagate_boolean(G_TASK(result), &err);
+
+	g_source_remove(job->progress_source);
+	if(job->progress_fd >= 0)
+		close(job->progress_fd);
+	set_busy(w, NULL, NULL);
+	if(ok) {
+		set_clean(w);
+		if(job->filename) {
 			free(w->filename);
-			w->filename = filename;
+			w->filename = job->filename;
+			job->filename = NULL;
 			update_title(w);
-			ret = TRUE;
-		} else
-			free(filename);
+		}
+	} else if(!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		fprintf(stderr, "Could not save %s: %s\n", job->target, err->message);
+	}
+	g_clear_error(&err);
+	run_continuation(w, job->next, ok, job->data);
+	save_job_free(job);
+}
+
+static void save_registered(WemedWindow* w, gboolean ok, gpointer data) {
+	struct SaveJob* job = data;
+	job->w = w;
+	job->model = w->model;
+	job->target = g_strdup(job->filename ?: w->filename);
+	job->tmpname = g_strdup_printf("%s.XXXXXX", job->target);
+	job->fd = ok ? mkstemp(job->tmpname) : -1;
+	if(job->fd >= 0) {
+		struct stat st;
+		if(stat(job->target, &st) == 0) { // keep the original's permissions
+			fchmod(job->fd, st.st_mode & 07777);
+		} else {
+			// mkstemp creates the file 0600; a new file gets the usual mode
+			mode_t mask = umask(0);
+			umask(mask);
+			fchmod(job->fd, 0666 & ~mask);
+		}
+		job->fp = fdopen(job->fd, "wb");
+		if(!job->fp) {
+			close(job->fd);
+			unlink(job->tmpname);
+		}
+	}
+	if(!job->fp) {
+		if(ok)
+			fprintf(stderr, "Could not save %s: %s\n", job->target, strerror(errno));
+		run_continuation(w, job->next, FALSE, job->data);
+		save_job_free(job);
+		return;
 	}
+	// GMime writes in small pieces
+	setvbuf(job->fp, NULL, _IOFBF, 1024 * 1024);
+	job->estimate = mime_model_size_estimate(w->model);
+	job->progress_fd = job->estimate > 0 ? fcntl(job->fd, F_DUPFD_CLOEXEC, 0) : -1;
+
+	GCancellable* cancellable = g_cancellable_new();
+	set_busy(w, cancellable, _("Saving..."));
+	job->progress_source = g_timeout_add(100, save_progress, job);
+	GTask* task = g_task_new(NULL, cancellable, document_written, job);
+	g_task_set_task_data(task, job, NULL);
+	g_task_run_in_thread(task, write_document_thread);
+	g_object_unref(task);
+	g_object_unref(cancellable);
+}
+
+// writes the document once the view's changes are in the model, then
+// calls next with whether it was saved
+static void save_document(WemedWindow* w, char* filename, WindowContinuation next, gpointer data) {
+	struct SaveJob* job = g_new0(struct SaveJob, 1);
+	job->filename = filename;
+	job->next = next;
+	job->data = data;
+	register_changes(w, save_registered, job);
+}
 
+static void save_as(WemedWindow* w, WindowContinuation next, gpointer data) {
+
+	GtkWidget *dialog = gtk_file_chooser_dialog_new (_("Save File"), GTK_WINDOW(w->root_window), GTK_FILE_CHOOSER_ACTION_SAVE, _("_Cancel"), GTK_RESPONSE_CANCEL, _("_Save"), GTK_RESPONSE_ACCEPT, NULL);
+	gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
+	if(w->filename)
+		gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), w->filename);
+
+	char* filename = NULL;
+	if(gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT)
+		filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER (dialog));
 	gtk_widget_destroy(dialog);
-	return ret;
+
+	if(filename)
+		save_document(w, filename, next, data);
+	else
+		run_continuation(w, next, FALSE, data);
 }
 
-static gboolean menu_file_save(GtkMenuItem* item, WemedWindow* w) {
+static void save(WemedWindow* w, WindowContinuation next, gpointer data) {
 	if(w->filename == NULL) // run 'Save As' instead
-		return menu_file_save_as(NULL, w);
-	else {
-		FILE* fp = fopen(w->filename, "wb");
-		if(!fp) return FALSE;
-		register_changes(w);
-		gboolean ret = mime_model_write_to_file(w->model, fp);
-		if(ret)
-			set_clean(w);
-		return ret;
-	}
+		save_as(w, next, data);
+	else
+		save_document(w, NULL, next, data);
 }
 
-// returns a boolean of whether the user accepts a close or not so the function
+static void menu_file_save_as(GtkMenuItem* item, WemedWindow* w) {
+	save_as(w, NULL, NULL);
+}
+
+static void menu_file_save(GtkMenuItem* item, WemedWindow* w) {
+	save(w, NULL, NULL);
+}
+
+// calls next with whether the user accepts a close or not so the function
 // can be reused when creating or opening a new document
-static gboolean confirm_close(WemedWindow* w) {
+static void confirm_close(WemedWindow* w, WindowContinuation next, gpointer data) {
 	if(w->dirty) {
 		GtkWidget* dialog = gtk_message_dialog_new(
 		                        GTK_WINDOW(w->root_window),
@@ -325,34 +1008,42 @@ static gboolean confirm_close(WemedWindow* w) {
 		gtk_widget_destroy(dialog);
 		if(ret == GTK_RESPONSE_YES) {
 			// if saving fails, DON'T close
-			if(menu_file_save(NULL, w) != TRUE)
-				return FALSE;
-		} else if(ret != GTK_RESPONSE_NO)
+			save(w, next, data);
+			return;
+		} else if(ret != GTK_RESPONSE_NO) {
 			// GTK_RESPONSE_NO falls through to close
-			return FALSE;
+			run_continuation(w, next, FALSE, data);
+			return;
+		}
 	}
-	return TRUE;
+	run_continuation(w, next, TRUE, data);
 }
 
-static gboolean menu_file_close(GtkMenuItem* item, WemedWindow* w) {
-	if(confirm_close(w)) {
+static void close_confirmed(WemedWindow* w, gboolean ok, gpointer data) {
+	if(ok)
 		close_document(w);
-		return TRUE;
-	} else
-		return FALSE;
 }
 
-static gboolean menu_file_quit(GtkMenuItem* item, WemedWindow* w) {
-	if(confirm_close(w)) {// register_changes called in confirm_close
+static void menu_file_close(GtkMenuItem* item, WemedWindow* w) {
+	confirm_close(w, close_confirmed, NULL);
+}
+
+static void quit_confirmed(WemedWindow* w, gboolean ok, gpointer data) {
+	if(ok) {
 		close_document(w);
 		gtk_main_quit();
-		return TRUE;
 	}
-	return FALSE;
+}
+
+static void menu_file_quit(GtkMenuItem* item, WemedWindow* w) {
+	confirm_close(w, quit_confirmed, NULL); // register_changes called when saving
 }
 
 static gboolean delete_event_handler(GtkWidget* window, GdkEvent* ev, WemedWindow* w) {
-	return !menu_file_quit(NULL, w);
+	// the window goes away with gtk_main_quit once the close is confirmed
+	if(!w->busy_cancellable)
+		menu_file_quit(NULL, w);
+	return TRUE;
 }
 
 static void menu_file_reload(GtkMenuItem* item, WemedWindow* w) {
@@ -372,8 +1063,8 @@ static void menu_file_reload(GtkMenuItem* item, WemedWindow* w) {
 	free(f);
 }
 
-static void menu_file_open(GtkMenuItem* item, WemedWindow* w) {
-	if(confirm_close(w) == FALSE)
+static void open_confirmed(WemedWindow* w, gboolean ok, gpointer data) {
+	if(!ok)
 		return;
 
 	GtkWidget *dialog = gtk_file_chooser_dialog_new (_("Open File"),
@@ -392,46 +1083,62 @@ static void menu_file_open(GtkMenuItem* item, WemedWindow* w) {
 	gtk_widget_destroy (dialog);
 }
 
-static void menu_file_new(GtkMenuItem* item, WemedWindow* w) {
-	if(confirm_close(w) == FALSE)
+static void menu_file_open(GtkMenuItem* item, WemedWindow* w) {
+	confirm_close(w, open_confirmed, NULL);
+}
+
+static void new_confirmed(WemedWindow* w, gboolean ok, gpointer data) {
+	if(!ok)
 		return;
 
 	close_document(w);
-	GString s = {0};
-	set_model(w, mime_model_new(s));
+	set_model(w, mime_model_new(NULL));
 }
 
+static void menu_file_new(GtkMenuItem* item, WemedWindow* w) {
+	confirm_close(w, new_confirmed, NULL);
+}
 
-static void menu_file_new_email(GtkMenuItem* item, WemedWindow* w) {
-	if(confirm_close(w) == FALSE)
+static void new_email_confirmed(WemedWindow* w, gboolean ok, gpointer data) {
+	if(!ok)
 		return;
 
 	close_document(w);
-	GString s = {0};
-	MimeModel* m = mime_model_new(s);
+	MimeModel* m = mime_model_new(NULL);
 	mime_model_create_blank_email(m);
 	set_model(w, m);
 }
 
-static void menu_view_html_source(GtkCheckMenuItem* item, WemedWindow* w) {
-	register_changes(w);
-	gboolean source = gtk_check_menu_item_get_active(item);
+static void menu_file_new_email(GtkMenuItem* item, WemedWindow* w) {
+	confirm_close(w, new_email_confirmed, NULL);
+}
+
+static void reload_current_part(WemedWindow* w, gboolean ok, gpointer data) {
+	set_current_part(w, w->current_part);
+}
+
+// the content has to be fetched from whichever view was showing it,
+// so only switch over once that's done
+static void html_source_registered(WemedWindow* w, gboolean ok, gpointer data) {
+	gboolean source = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(data));
 	wemed_panel_show_source(WEMED_PANEL(w->panel), source);
 	set_current_part(w, w->current_part);
 }
 
+static void menu_view_html_source(GtkCheckMenuItem* item, WemedWindow* w) {
+	register_changes(w, html_source_registered, item);
+}
+
 static void menu_view_remote_resources(GtkCheckMenuItem* item, WemedWindow* w) {
-	register_changes(w);
 	gboolean remote = gtk_check_menu_item_get_active(item);
 	wemed_panel_load_remote_resources(WEMED_PANEL(w->panel), remote);
-	set_current_part(w, w->current_part);
+	register_changes(w, reload_current_part, NULL);
 }
 
 static void menu_view_display_images(GtkCheckMenuItem* item, WemedWindow* w) {
-	register_changes(w);
 	gboolean images = gtk_check_menu_item_get_active(item);
 	wemed_panel_display_images(WEMED_PANEL(w->panel), images);
-	set_current_part(w, w->current_part);
+	register_changes(w, reload_current_part, NULL);
 }
 
 static void menu_view_inline_parts(GtkCheckMenuItem* item, WemedWindow* w) {
@@ -472,34 +1179,150 @@ static void menu_part_new_empty(GtkMenuItem* item, WemedWindow* w) {
 	expand_mime_tree_view(w);
 }
 
-static char* import_file_into_tree(WemedWindow* w,  GMimeObject* parent_or_sibling, const char* filename, const char* disposition) {
+// A file to be added as a new part. Finding its content type means
+// reading it, so that's done on a worker thread
+struct ImportFile {
+	char* filename;
+	char* mime_type;
+};
+
+struct ImportJob {
+	WemedWindow* w;
+	MimeModel* model;
+	GMimeObject* parent_or_sibling;
+	const char* disposition;
+	// the part shown in the panel, when the files are images to insert
+	// into its HTML
+	GMimeObject* inline_into;
+	struct ImportFile* files;
+	guint n_files;
+	guint pending;
+};
+
+static char* import_file_into_tree(WemedWindow* w,  GMimeObject* parent_or_sibling, const struct ImportFile* file, const char* disposition) {
 	static int partnum = 0;
-	char* mime_type = get_file_mime_type(filename);
-	GMimePart* part = GMIME_PART(mime_model_new_node(w->model, parent_or_sibling, mime_type));
+	GMimePart* part = GMIME_PART(mime_model_new_node(w->model, parent_or_sibling, file->mime_type));
 	g_mime_part_set_content_encoding(part, GMIME_CONTENT_ENCODING_BASE64);
-	GString content = slurp_and_close(fopen(filename, "rb"));
-	if(!content.str)
+	// not read until it's needed, so large files don't have to fit in memory
+	if(!mime_model_set_part_file(w->model, part, file->filename)) {
+		// don't leave an empty part behind
+		mime_model_part_remove(w->model, (GMimeObject*) part);
 		return NULL;
-	mime_model_update_content(w->model, part, content);
+	}
 	char* cid;
 	asprintf(&cid, "part%d_%u", partnum++, (unsigned int)time(0));
 	g_mime_part_set_content_id(part, cid);
-	char* slashpos = strrchr(filename, '/');
-	g_mime_part_set_filename(part, slashpos? &slashpos[1] : filename);
+	char* slashpos = strrchr(file->filename, '/');
+	g_mime_part_set_filename(part, slashpos? &slashpos[1] : file->filename);
 	if(disposition)
 		g_mime_object_set_disposition((GMimeObject*) part, disposition);
 	GString s = {0};
 	s.str = g_mime_object_get_headers((GMimeObject*) part, g_mime_format_options_get_default());
 	s.len = strlen(s.str);
 	mime_model_update_header(w->model, (GMimeObject*) part, s);
-	free(mime_type);
-	expand_mime_tree_view(w);
+	g_free(s.str);
 	return cid;
 }
 
-static char* import_file_cb(WemedPanel* p, const char* filename, WemedWindow* w) {
+static void import_job_free(struct ImportJob* job) {
+	for(guint i = 0; i < job->n_files; ++i) {
+		g_free(job->files[i].filename);
+		free(job->files[i].mime_type);
+	}
+	g_free(job->files);
+	g_object_unref(job->parent_or_sibling);
+	if(job->inline_into)
+		g_object_unref(job->inline_into);
+	g_free(job);
+}
+
+static void sniff_file_thread(GTask* task, gpointer source_object, gpointer task_data, GCancellable* cancellable) {
+	struct ImportFile* file = task_data;
+	file->mime_type = get_file_mime_type(file->filename);
+	g_task_return_boolean(task, TRUE);
+}
+
+// Adds the sniffed files to the tree, once nothing else is using the model
+static gboolean insert_imported_files(gpointer user_data) {
+	struct ImportJob* job = user_data;
+	WemedWindow* w = job->w;
+	// the document may have been closed, or the part removed, meanwhile
+	gboolean current = w->model == job->model && mime_model_contains(w->model, job->parent_or_sibling);
+	if(current && (w->busy_cancellable || w->registering)) {
+		// the document is being saved or the panel's edits are being
+		// fetched; try again afterwards
+		g_timeout_add(100, insert_imported_files, job);
+		return G_SOURCE_REMOVE;
+	}
+	if(current) {
+		GPtrArray* cids = g_ptr_array_new_with_free_func(free);
+		for(guint i = 0; i < job->n_files; ++i) {
+			char* cid = import_file_into_tree(w, job->parent_or_sibling, &job->files[i], job->disposition);
+			if(cid)
+				g_ptr_array_add(cids, cid);
+		}
+		if(cids->len > 0) {
+			set_dirtied(NULL, w);
+			expand_mime_tree_view(w);
+			if(job->inline_into && job->inline_into == w->current_part) {
+				g_ptr_array_add(cids, NULL);
+				wemed_panel_insert_images(WEMED_PANEL(w->panel), (const char* const*) cids->pdata);
+			}
+		}
+		g_ptr_array_free(cids, TRUE);
+	}
+	import_job_free(job);
+	return G_SOURCE_REMOVE;
+}
+
+static void file_sniffed(GObject* source_object, GAsyncResult* result, gpointer user_data) {
+	struct ImportJob* job = user_data;
+	if(--job->pending > 0)
+		return;
+	insert_imported_files(job);
+}
+
+// Imports files as new parts. The files are examined concurrently on
+// worker threads and the parts are added together once they're done
+static void import_files(WemedWindow* w, GMimeObject* parent_or_sibling, char** filenames, const char* disposition, gboolean inline_images) {
+	guint n = g_strv_length(filenames);
+	if(n == 0)
+		return;
+	struct ImportJob* job = g_new0(struct ImportJob, 1);
+	job->w = w;
+	job->model = w->model;
+	job->parent_or_sibling = g_object_ref(parent_or_sibling);
+	job->disposition = disposition;
+	if(inline_images)
+		job->inline_into = g_object_ref(w->current_part);
+	job->files = g_new0(struct ImportFile, n);
+	job->n_files = n;
+	job->pending = n;
+	for(guint i = 0; i < n; ++i) {
+		job->files[i].filename = g_strdup(filenames[i]);
+		GTask* task = g_task_new(NULL, NULL, file_sniffed, job);
+		g_task_set_task_data(task, &job->files[i], NULL);
+		g_task_run_in_thread(task, sniff_file_thread);
+		g_object_unref(task);
+	}
+}
+
+static gboolean cid_requested_cb(WemedPanel* p, const char* cid, WemedPanelResource* res, WemedWindow* w) {
+	GMimeObject* part = w->model ? mime_model_find_cid(w->model, cid) : NULL;
+	if(part == NULL)
+		return FALSE;
+	res->stream = mime_model_part_stream(w->model, part, &res->length);
+	if(res->stream == NULL)
+		return FALSE;
+	res->content_type = mime_model_content_type(part);
+	return TRUE;
+}
+
+static void import_files_cb(WemedPanel* p, char** filenames, WemedWindow* w) {
+	if(w->current_part == NULL)
+		return;
 	GMimeObject* parent = mime_model_find_mixed_parent(w->model, w->current_part);
-	return import_file_into_tree(w, parent?:w->current_part, filename, GMIME_DISPOSITION_INLINE);
+	import_files(w, parent?:w->current_part, filenames, GMIME_DISPOSITION_INLINE, TRUE);
 }
 
 static void menu_part_new_from_file(GtkMenuItem* item, WemedWindow* w) {
@@ -509,29 +1332,54 @@ static void menu_part_new_from_file(GtkMenuItem* item, WemedWindow* w) {
 	                         _("_Cancel"), GTK_RESPONSE_CANCEL,
 	                         _("_Open"), GTK_RESPONSE_ACCEPT,
 	                         NULL);
-
-	if(gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
-		char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-		import_file_into_tree(w, w->current_part, filename, GMIME_DISPOSITION_ATTACHMENT);
-		free(filename);
+	gtk_file_chooser_set_select_multiple(GTK_FILE_CHOOSER(dialog), TRUE);
+
+	if(gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT && w->current_part) {
+		GSList* files = gtk_file_chooser_get_filenames(GTK_FILE_CHOOSER(dialog));
+		GPtrArray* filenames = g_ptr_array_new_with_free_func(g_free);
+		for(GSList* p = files; p; p = p->next)
+			g_ptr_array_add(filenames, p->data);
+		g_ptr_array_add(filenames, NULL);
+		import_files(w, w->current_part, (char**) filenames->pdata, GMIME_DISPOSITION_ATTACHMENT, FALSE);
+		g_ptr_array_free(filenames, TRUE);
+		g_slist_free(files);
 	}
 
 	gtk_widget_destroy (dialog);
 }
 
+static void edit_registered(WemedWindow* w, gboolean ok, gpointer data) {
+	char* exec = data;
+	if(ok && w->current_part && GMIME_IS_PART(w->current_part))
+		open_part_with_external_app(w, GMIME_PART(w->current_part), exec);
+	free(exec);
+}
+
 static void menu_part_edit(GtkMenuItem* item, WemedWindow* w) {
-	register_changes(w);
-	open_part_with_external_app(w, GMIME_PART(w->current_part), w->mime_app.exec);
+	if(w->mime_app.exec == NULL)
+		return;
+	register_changes(w, edit_registered, strdup(w->mime_app.exec));
+}
+
+static void view_registered(WemedWindow* w, gboolean ok, gpointer data) {
+	char* exec = data;
+	if(ok && w->current_part && GMIME_IS_PART(w->current_part))
+		view_part_in_external_app(w, GMIME_PART(w->current_part), exec);
+	free(exec);
+}
+
+static void menu_part_view(GtkMenuItem* item, WemedWindow* w) {
+	if(w->mime_app.exec == NULL)
+		return;
+	register_changes(w, view_registered, strdup(w->mime_app.exec));
 }
 
 static void menu_part_edit_with(GtkMenuItem* item, WemedWindow* w) {
 	char* content_type_name = mime_model_content_type(w->current_part);
 	char* exec = open_with(w->root_window, content_type_name);
 	free(content_type_name);
-	if(exec) {
-		register_changes(w);
-		open_part_with_external_app(w, GMIME_PART(w->current_part), exec);
-	}
+	if(exec)
+		register_changes(w, edit_registered, exec);
 
 }
 
@@ -543,6 +1391,21 @@ static void panel_edit_external(WemedPanel* panel, gboolean open_with, WemedWind
 	}
 }
 
+static void export_registered(WemedWindow* w, gboolean ok, gpointer data) {
+	char* filename = data;
+	if(ok && w->current_part && GMIME_IS_PART(w->current_part)) {
+		FILE* fp = fopen(filename, "wb");
+		if(fp == NULL) {
+			fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+		} else {
+			gboolean written = mime_model_write_part(GMIME_PART(w->current_part), fp);
+			if(fclose(fp) != 0 || !written)
+				fprintf(stderr, "Could not write %s\n", filename);
+		}
+	}
+	free(filename);
+}
+
 static void menu_part_export(GtkMenuItem* item, WemedWindow* w) {
 	GtkWidget *dialog = gtk_file_chooser_dialog_new(
 	                        _("Save File"),
@@ -556,13 +1419,187 @@ static void menu_part_export(GtkMenuItem* item, WemedWindow* w) {
 	gtk_file_chooser_set_do_overwrite_confirmation (GTK_FILE_CHOOSER (dialog), TRUE);
 	gtk_file_chooser_set_current_name (GTK_FILE_CHOOSER (dialog), g_mime_part_get_filename(GMIME_PART(w->current_part)));
 
-	if(gtk_dialog_run(GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT) {
-		register_changes(w);
-		char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-		FILE* fp = fopen(filename, "wb");
-		mime_model_write_part(GMIME_PART(w->current_part), fp);
-		free(filename);
+	if(gtk_dialog_run(GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT)
+		register_changes(w, export_registered, gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog)));
+	gtk_widget_destroy (dialog);
+}
+
+// Exporting every part with content into a directory. The parts are
+// written concurrently by a pool of worker threads
+struct ExportJob {
+	WemedWindow* w;
+	GThreadPool* pool;
+	GCancellable* cancellable;
+	char* dirname;
+	int dirfd;
+	guint n_parts;
+	// updated by the workers
+	gint done;
+	gint failed;
+	guint progress_source;
+};
+
+struct ExportItem {
+	struct ExportJob* job;
+	GMimeObject* part;
+	char* name;
+};
+
+static void collect_leaves(GMimeObject* obj, GPtrArray* leaves) {
+	if(GMIME_IS_MULTIPART(obj)) {
+		GMimeMultipart* mp = GMIME_MULTIPART(obj);
+		for(int i = 0; i < g_mime_multipart_get_count(mp); ++i)
+			collect_leaves(g_mime_multipart_get_part(mp, i), leaves);
+	} else if(GMIME_IS_PART(obj) || GMIME_IS_MESSAGE_PART(obj)) {
+		g_ptr_array_add(leaves, obj);
 	}
+}
+
+// A name for the exported part. Filenames come from the message, so they
+// are stripped of anything that would lead outside the directory
+static char* export_name(GMimeObject* part, guint index) {
+	const char* filename = GMIME_IS_PART(part) ? g_mime_part_get_filename(GMIME_PART(part)) : NULL;
+	if(filename && *filename && strcmp(filename, ".") != 0 && strcmp(filename, "..") != 0)
+		return g_strdelimit(g_strdup(filename), "/", '_');
+	if(GMIME_IS_MESSAGE_PART(part))
+		return g_strdup_printf("part%u.eml", index);
+	return g_strdup_printf("part%u", index);
+}
+
+// Creates a file in dirfd named name, or "name (2)" etc. if that exists.
+// *created receives the name used
+static int create_unique(int dirfd, const char* name, char** created) {
+	const char* ext = strrchr(name, '.');
+	if(ext == NULL || ext == name)
+		ext = name + strlen(name);
+	for(guint n = 1; n < 1000; ++n) {
+		char* candidate = n == 1 ? g_strdup(name) : g_strdup_printf("%.*s (%u)%s", (int) (ext - name), name, n, ext);
+		int fd = openat(dirfd, candidate, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		if(fd >= 0 || errno != EEXIST) {
+			*created = candidate;
+			return fd;
+		}
+		g_free(candidate);
+	}
+	*created = NULL;
+	errno = EEXIST;
+	return -1;
+}
+
+static gboolean parts_exported(gpointer user_data) {
+	struct ExportJob* job = user_data;
+	WemedWindow* w = job->w;
+	g_thread_pool_free(job->pool, FALSE, TRUE);
+	g_source_remove(job->progress_source);
+	set_busy(w, NULL, NULL);
+	if(job->failed > 0 && !g_cancellable_is_cancelled(job->cancellable)) {
+		GtkWidget* dialog = gtk_message_dialog_new(
+		                        GTK_WINDOW(w->root_window),
+		                        GTK_DIALOG_DESTROY_WITH_PARENT,
+		                        GTK_MESSAGE_ERROR,
+		                        GTK_BUTTONS_CLOSE,
+		                        _("%d of %u parts could not be exported to %s"),
+		                        job->failed, job->n_parts, job->dirname);
+		gtk_dialog_run(GTK_DIALOG(dialog));
+		gtk_widget_destroy(dialog);
+	}
+	close(job->dirfd);
+	g_object_unref(job->cancellable);
+	g_free(job->dirname);
+	g_free(job);
+	return G_SOURCE_REMOVE;
+}
+
+static void export_part_thread(gpointer data, gpointer user_data) {
+	struct ExportItem* item = data;
+	struct ExportJob* job = item->job;
+	if(!g_cancellable_is_cancelled(job->cancellable)) {
+		char* created;
+		int fd = create_unique(job->dirfd, item->name, &created);
+		if(fd < 0) {
+			fprintf(stderr, "Could not create %s in %s: %s\n", item->name, job->dirname, strerror(errno));
+			g_atomic_int_inc(&job->failed);
+		} else {
+			gboolean ok = mime_model_export_part(item->part, fd, job->cancellable);
+			if(close(fd) != 0)
+				ok = FALSE;
+			if(!ok) {
+				if(!g_cancellable_is_cancelled(job->cancellable))
+					fprintf(stderr, "Could not export %s to %s\n", created, job->dirname);
+				unlinkat(job->dirfd, created, 0);
+				g_atomic_int_inc(&job->failed);
+			}
+		}
+		g_free(created);
+	}
+	g_object_unref(item->part);
+	g_free(item->name);
+	g_free(item);
+	if((guint) g_atomic_int_add(&job->done, 1) + 1 == job->n_parts)
+		g_idle_add(parts_exported, job);
+}
+
+static gboolean export_progress(gpointer user_data) {
+	struct ExportJob* job = user_data;
+	guint done = g_atomic_int_get(&job->done);
+	char* text = g_strdup_printf(_("Exporting part %u of %u..."), MIN(done + 1, job->n_parts), job->n_parts);
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(job->w->busy_progress), text);
+	gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(job->w->busy_progress), (double) done / job->n_parts);
+	g_free(text);
+	return G_SOURCE_CONTINUE;
+}
+
+static void export_all_registered(WemedWindow* w, gboolean ok, gpointer data) {
+	char* dirname = data;
+	int dirfd = ok && w->model ? open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+	if(dirfd < 0) {
+		if(ok && w->model)
+			fprintf(stderr, "Could not open %s: %s\n", dirname, strerror(errno));
+		g_free(dirname);
+		return;
+	}
+	GPtrArray* parts = g_ptr_array_new();
+	collect_leaves(mime_model_root(w->model), parts);
+	if(parts->len == 0) {
+		g_ptr_array_free(parts, TRUE);
+		close(dirfd);
+		g_free(dirname);
+		return;
+	}
+
+	struct ExportJob* job = g_new0(struct ExportJob, 1);
+	job->w = w;
+	job->cancellable = g_cancellable_new();
+	job->dirname = dirname;
+	job->dirfd = dirfd;
+	job->n_parts = parts->len;
+	job->pool = g_thread_pool_new(export_part_thread, job, g_get_num_processors(), FALSE, NULL);
+	// the parts mustn't change while the workers read them
+	set_busy(w, job->cancellable, _("Exporting..."));
+	for(guint i = 0; i < parts->len; ++i) {
+		struct ExportItem* item = g_new0(struct ExportItem, 1);
+		item->job = job;
+		item->part = g_object_ref(parts->pdata[i]);
+		item->name = export_name(item->part, i + 1);
+		g_thread_pool_push(job->pool, item, NULL);
+	}
+	job->progress_source = g_timeout_add(100, export_progress, job);
+	g_ptr_array_free(parts, TRUE);
+}
+
+static void menu_part_export_all(GtkMenuItem* item, WemedWindow* w) {
+	GtkWidget *dialog = gtk_file_chooser_dialog_new(
+	                        _("Export All Parts"),
+	                        GTK_WINDOW(w->root_window),
+	                        GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
+	                        _("_Cancel"),
+	                        GTK_RESPONSE_CANCEL,
+	                        _("_Export"),
+	                        GTK_RESPONSE_ACCEPT,
+	                        NULL);
+
+	if(gtk_dialog_run(GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT)
+		register_changes(w, export_all_registered, gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog)));
 	gtk_widget_destroy (dialog);
 }
 
@@ -740,6 +1777,11 @@ static GtkWidget* build_menubar(WemedWindow* w) {
 			gtk_widget_add_accelerator(fromfile, "activate", acc, GDK_KEY_f, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
 		}
 		gtk_menu_shell_append(GTK_MENU_SHELL(partmenu), gtk_separator_menu_item_new());
+		{ // Part -> View
+			m->menu_part_view = gtk_menu_item_new_with_label(_("View...")); // this label will be changed
+			gtk_menu_shell_append(GTK_MENU_SHELL(partmenu), m->menu_part_view);
+			g_signal_connect(G_OBJECT(m->menu_part_view), "activate", G_CALLBACK(menu_part_view), w);
+		}
 		{ // Part -> Edit
 			m->menu_part_edit = gtk_menu_item_new_with_label(_("Edit...")); // this label will be changed
 			gtk_menu_shell_append(GTK_MENU_SHELL(partmenu), m->menu_part_edit);
@@ -759,6 +1801,12 @@ static GtkWidget* build_menubar(WemedWindow* w) {
 			g_signal_connect(G_OBJECT(m->menu_part_export), "activate", G_CALLBACK(menu_part_export), w);
 			gtk_widget_add_accelerator(m->menu_part_export, "activate", acc, GDK_KEY_x, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
 		}
+		{ // Part -> Export All
+			GtkWidget* export_all = gtk_menu_item_new_with_mnemonic(_("Export _All Parts..."));
+			gtk_menu_shell_append(GTK_MENU_SHELL(partmenu), export_all);
+			g_signal_connect(G_OBJECT(export_all), "activate", G_CALLBACK(menu_part_export_all), w);
+			gtk_widget_add_accelerator(export_all, "activate", acc, GDK_KEY_x, GDK_SHIFT_MASK | GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
+		}
 		gtk_menu_shell_append(GTK_MENU_SHELL(partmenu), gtk_separator_menu_item_new());
 		{ // Part -> Delete
 			m->menu_part_delete = gtk_menu_item_new_with_mnemonic(_("_Delete"));
@@ -795,8 +1843,26 @@ static GtkWidget* build_menubar(WemedWindow* w) {
 	return menubar;
 }
 
+// Maps the file rather than reading it, so the parts of even very large
+// documents aren't copied into memory until they are edited
+static GMimeStream* open_document_stream(const char* filename) {
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	GMimeStream* stream = g_mime_stream_mmap_new(fd, PROT_READ, MAP_PRIVATE);
+	if(!stream) // e.g. an empty file, or a filesystem without mmap support
+		stream = g_mime_stream_fs_new(fd);
+	return stream;
+}
+
 gboolean wemed_window_open(WemedWindow* w, const char* filename) {
-	MimeModel* m = mime_model_new(slurp_and_close(fopen(filename, "rb")));
+	GMimeStream* stream = open_document_stream(filename);
+	if(!stream)
+		return FALSE;
+	MimeModel* m = mime_model_new(stream);
+	g_object_unref(stream);
 	if(m) {
 		set_model(w, m);
 		w->filename = strdup(filename);
@@ -817,9 +1883,9 @@ WemedWindow* wemed_window_create() {
 	gtk_window_set_default_size(GTK_WINDOW(w->root_window), 720, 576);
 	g_signal_connect(w->root_window, "delete-event", G_CALLBACK(delete_event_handler), w);
 	GtkWidget* vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
-	GtkWidget* menubar = build_menubar(w);
+	w->menubar = build_menubar(w);
 
-	gtk_box_pack_start(GTK_BOX(vbox), menubar, FALSE, FALSE, 3);
+	gtk_box_pack_start(GTK_BOX(vbox), w->menubar, FALSE, FALSE, 3);
 	w->paned = gtk_paned_new(GTK_ORIENTATION_HORIZONTAL);
 
 	w->mime_tree = mime_tree_new();
@@ -830,7 +1896,8 @@ WemedWindow* wemed_window_create() {
 	gtk_paned_add1(GTK_PANED(w->paned), treeviewwin);
 
 	w->panel = wemed_panel_new();
-	g_signal_connect(w->panel, "import-file", G_CALLBACK(import_file_cb), w);
+	g_signal_connect(w->panel, "import-files", G_CALLBACK(import_files_cb), w);
+	g_signal_connect(w->panel, "cid-requested", G_CALLBACK(cid_requested_cb), w);
 	g_signal_connect(w->panel, "dirtied", G_CALLBACK(set_dirtied), w);
 	g_signal_connect(w->panel, "open-external", G_CALLBACK(panel_edit_external), w);
 	gtk_paned_add2(GTK_PANED(w->paned), w->panel);
@@ -839,9 +1906,20 @@ WemedWindow* wemed_window_create() {
 
 	gtk_box_pack_start(GTK_BOX(vbox), w->paned, TRUE, TRUE, 0);
 
+	w->busy_bar = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+	w->busy_progress = gtk_progress_bar_new();
+	gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(w->busy_progress), TRUE);
+	gtk_widget_set_valign(w->busy_progress, GTK_ALIGN_CENTER);
+	gtk_box_pack_start(GTK_BOX(w->busy_bar), w->busy_progress, TRUE, TRUE, 0);
+	GtkWidget* busy_cancel = gtk_button_new_with_mnemonic(_("_Cancel"));
+	g_signal_connect_swapped(busy_cancel, "clicked", G_CALLBACK(cancel_busy), w);
+	gtk_box_pack_start(GTK_BOX(w->busy_bar), busy_cancel, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(vbox), w->busy_bar, FALSE, FALSE, 3);
+
 	gtk_container_add(GTK_CONTAINER(w->root_window), vbox);
 
 	gtk_widget_show_all(w->root_window);
+	gtk_widget_hide(w->busy_bar);
 
 	close_document(w); // initially, all widgets should be disabled etc.
 
@@ -1,61 +1,277 @@
 /* Copyright 2013 Oliver Giles
- * This file is part of Wemed. Wemed is licensed under the 
+ * This file is part of Wemed. Wemed is licensed under the
  * GNU GPL version 3. See LICENSE or <http://www.gnu.org/licenses/>
  * for more information */
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <sys/stat.h>
-#include "exec.h"
+#include <gio/gio.h>
 #include "mimeapp.h"
 
+// content type -> struct Application*, resolved in-process through GIO.
+// Negative results are cached too (an Application with NULL members)
+static GHashTable* default_apps;
+static GList* monitors;
+
+// every application able to open each content type, built in the background
+struct AppIndex {
+	GPtrArray* apps; // owns the struct MimeAppEntry*
+	GHashTable* by_type; // content type -> GPtrArray* of struct MimeAppEntry*
+};
+
+static struct AppIndex* app_index;
+static gboolean app_index_building;
+static guint app_index_rebuild_source;
+
+// lookups made before the first build completes
+struct IndexWaiter {
+	char* content_type;
+	GCancellable* cancellable;
+	MimeAppIndexCallback callback;
+	gpointer user_data;
+};
+static GList* app_index_waiters;
+
+static void mime_app_index_rebuild(void);
+
+static void free_application(struct Application* a) {
+	free(a->name);
+	free(a->exec);
+	g_free(a);
+}
+
+// any change to the installed applications or to mimeapps.list may change
+// the default application for any type, so just start again
+static void applications_changed(GFileMonitor* monitor, GFile* file, GFile* other, GFileMonitorEvent event, gpointer user_data) {
+	if(event == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT || event == G_FILE_MONITOR_EVENT_CREATED || event == G_FILE_MONITOR_EVENT_DELETED) {
+		g_hash_table_remove_all(default_apps);
+		mime_app_index_rebuild();
+	}
+}
+
+static void watch_directory(const char* path) {
+	GFile* dir = g_file_new_for_path(path);
+	GFileMonitor* monitor = g_file_monitor_directory(dir, G_FILE_MONITOR_NONE, NULL, NULL);
+	if(monitor) {
+		g_signal_connect(monitor, "changed", G_CALLBACK(applications_changed), NULL);
+		monitors = g_list_prepend(monitors, monitor);
+	}
+	g_object_unref(dir);
+}
+
+static void init_default_apps(void) {
+	default_apps = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) free_application);
+
+	char* path = g_build_filename(g_get_user_data_dir(), "applications", NULL);
+	watch_directory(path);
+	g_free(path);
+	for(const gchar* const* dir = g_get_system_data_dirs(); *dir; ++dir) {
+		path = g_build_filename(*dir, "applications", NULL);
+		watch_directory(path);
+		g_free(path);
+	}
+	// user overrides in mimeapps.list
+	watch_directory(g_get_user_config_dir());
+}
+
 struct Application get_default_mime_app(const char* mimetype) {
+	if(!default_apps)
+		init_default_apps();
+
+	struct Application* cached = g_hash_table_lookup(default_apps, mimetype);
+	if(!cached) {
+		cached = g_new0(struct Application, 1);
+		GAppInfo* info = g_app_info_get_default_for_type(mimetype, FALSE);
+		if(info) {
+			cached->name = strdup(g_app_info_get_name(info));
+			// just the executable, as the Exec key's field codes are handled
+			// when the application is launched
+			const char* exec = g_app_info_get_executable(info);
+			cached->exec = exec ? strdup(exec) : NULL;
+			g_object_unref(info);
+		}
+		g_hash_table_insert(default_apps, g_strdup(mimetype), cached);
+	}
+
 	struct Application a = {0,0};
-	char buffer[64];
+	if(cached->exec) {
+		a.name = strdup(cached->name);
+		a.exec = strdup(cached->exec);
+	}
+	return a;
+}
+
+char* get_file_mime_type(const char* filename) {
+	char* ret = NULL;
+	GFile* file = g_file_new_for_path(filename);
+	// this sniffs the content of the file as well as using its name
+	GFileInfo* info = g_file_query_info(file, G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE, G_FILE_QUERY_INFO_NONE, NULL, NULL);
+	if(info) {
+		const char* content_type = g_file_info_get_content_type(info);
+		char* mime_type = content_type ? g_content_type_get_mime_type(content_type) : NULL;
+		if(mime_type)
+			ret = strdup(mime_type);
+		g_free(mime_type);
+		g_object_unref(info);
+	}
+	g_object_unref(file);
+	return ret ?: strdup("application/octet-stream");
+}
 
-	const char* xdgmime[] = { "xdg-mime", "query", "default", mimetype, 0 };
-	if(exec_get(buffer, 63, "xdg-mime", xdgmime) < 0)
-		return a;
-	*strchrnul(buffer, '\n') = '\0';
+static void mime_app_entry_free(struct MimeAppEntry* e) {
+	g_free(e->name);
+	g_free(e->exec);
+	if(e->icon)
+		g_object_unref(e->icon);
+	g_free(e);
+}
+
+static void app_index_free(struct AppIndex* index) {
+	g_hash_table_destroy(index->by_type);
+	g_ptr_array_unref(index->apps);
+	g_free(index);
+}
+
+// Reduces a desktop entry command line to the form open_with callers
+// expect: the first file argument as %f and no other field codes
+static char* normalise_exec(const char* cmdline) {
+	GString* exec = g_string_new(NULL);
+	gboolean have_file = FALSE;
+	for(const char* p = cmdline; *p; ++p) {
+		if(*p != '%') {
+			g_string_append_c(exec, *p);
+			continue;
+		}
+		if(p[1] == '\0')
+			break;
+		++p;
+		if(strchr("fFuU", *p) && !have_file) {
+			g_string_append(exec, "%f");
+			have_file = TRUE;
+		} else if(*p == '%') {
+			g_string_append(exec, "%%");
+		}
+	}
+	return g_strstrip(g_string_free(exec, FALSE));
+}
 
-	struct stat st;
+static void build_index_thread(GTask* task, gpointer source_object, gpointer task_data, GCancellable* cancellable) {
+	struct AppIndex* index = g_new0(struct AppIndex, 1);
+	index->apps = g_ptr_array_new_with_free_func((GDestroyNotify) mime_app_entry_free);
+	index->by_type = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
 
-	char* path;
-	// first look for the .desktop file in the user's home
-	asprintf(&path, "%s/.local/share/applications/%s", getenv("HOME"), buffer);
-	if(stat(path, &st) != 0) {
-		free(path);
-		// if it doesn't exist, try the system path
-		asprintf(&path, "/usr/share/applications/%s", buffer);
+	GList* all = g_app_info_get_all();
+	for(GList* l = all; l; l = l->next) {
+		GAppInfo* info = l->data;
+		const char** types = g_app_info_get_supported_types(info);
+		const char* cmdline = g_app_info_get_commandline(info);
+		if(types && types[0] && cmdline) {
+			struct MimeAppEntry* e = g_new0(struct MimeAppEntry, 1);
+			e->name = g_strdup(g_app_info_get_name(info));
+			e->exec = normalise_exec(cmdline);
+			e->icon = g_app_info_get_icon(info);
+			if(e->icon)
+				g_object_ref(e->icon);
+			g_ptr_array_add(index->apps, e);
+			for(const char** t = types; *t; ++t) {
+				GPtrArray* list = g_hash_table_lookup(index->by_type, *t);
+				if(!list) {
+					list = g_ptr_array_new();
+					g_hash_table_insert(index->by_type, g_strdup(*t), list);
+				}
+				g_ptr_array_add(list, e);
+			}
+		}
 	}
+	g_list_free_full(all, g_object_unref);
+	g_task_return_pointer(task, index, (GDestroyNotify) app_index_free);
+}
 
-	const char* grep_exec[] = { "grep", "^Exec=", path, 0 };
-	if(exec_get(buffer, 63, "grep", grep_exec) < 0)
-		return free(path), a;
-	*strchrnul(buffer, '\n') = '\0';
+static void index_lookup(const char* content_type, MimeAppIndexCallback callback, gpointer user_data) {
+	// applications for the type itself, then for any types it is a subclass
+	// of (e.g. text/plain for text/x-csrc)
+	GPtrArray* result = g_ptr_array_new();
+	GPtrArray* exact = g_hash_table_lookup(app_index->by_type, content_type);
+	for(guint i = 0; exact && i < exact->len; ++i)
+		g_ptr_array_add(result, exact->pdata[i]);
 
-	char executable_path[64] = {0};
-	sscanf(buffer, "Exec=%48s", executable_path);
+	GHashTableIter it;
+	gpointer type, list;
+	g_hash_table_iter_init(&it, app_index->by_type);
+	while(g_hash_table_iter_next(&it, &type, &list)) {
+		if(strcmp(type, content_type) == 0 || !g_content_type_is_a(content_type, type))
+			continue;
+		GPtrArray* l = list;
+		for(guint i = 0; i < l->len; ++i) {
+			guint unused;
+			if(!g_ptr_array_find(result, l->pdata[i], &unused))
+				g_ptr_array_add(result, l->pdata[i]);
+		}
+	}
+	callback((const struct MimeAppEntry* const*) result->pdata, result->len, user_data);
+	g_ptr_array_unref(result);
+}
 
-	const char* grep_name[] = { "grep", "^Name=", path, 0 };
-	if(exec_get(buffer, 63, "grep", grep_name) < 0)
-		return free(path), a;
-	*strchrnul(buffer, '\n') = '\0';
+static void index_built(GObject* source, GAsyncResult* result, gpointer user_data) {
+	struct AppIndex* index = g_task_propagate_pointer(G_TASK(result), NULL);
+	app_index_building = FALSE;
+	if(!index)
+		return;
+	if(app_index)
+		app_index_free(app_index);
+	app_index = index;
 
-	char *executable_name = &buffer[sizeof("Name=")-1];
+	GList* waiters = g_list_reverse(app_index_waiters);
+	app_index_waiters = NULL;
+	for(GList* l = waiters; l; l = l->next) {
+		struct IndexWaiter* waiter = l->data;
+		if(!g_cancellable_is_cancelled(waiter->cancellable))
+			index_lookup(waiter->content_type, waiter->callback, waiter->user_data);
+		g_free(waiter->content_type);
+		g_clear_object(&waiter->cancellable);
+		g_free(waiter);
+	}
+	g_list_free(waiters);
+}
 
-	free(path);
+static gboolean rebuild_timeout(gpointer user_data) {
+	app_index_rebuild_source = 0;
+	mime_app_index_build();
+	return G_SOURCE_REMOVE;
+}
 
-	a.name = strdup(executable_name);
-	a.exec = strdup(executable_path);
+// package managers touch many files at once, so wait for things to settle
+static void mime_app_index_rebuild(void) {
+	if(app_index_rebuild_source)
+		g_source_remove(app_index_rebuild_source);
+	app_index_rebuild_source = g_timeout_add_seconds(2, rebuild_timeout, NULL);
+}
 
-	return a;
+void mime_app_index_build(void) {
+	if(!default_apps)
+		init_default_apps();
+	if(app_index_building) {
+		// try again once the running build is done
+		mime_app_index_rebuild();
+		return;
+	}
+	app_index_building = TRUE;
+	GTask* task = g_task_new(NULL, NULL, index_built, NULL);
+	g_task_run_in_thread(task, build_index_thread);
+	g_object_unref(task);
 }
 
-char* get_file_mime_type(const char* filename) {
-	char buffer[64] = {0};
-	const char* args[] = { "xdg-mime", "query", "filetype", filename, 0 };
-	if(exec_get(buffer, 63, "xdg-mime", args) < 0)
-		return 0;
-	return strdup(buffer);
+void mime_app_index_lookup(const char* content_type, GCancellable* cancellable, MimeAppIndexCallback callback, gpointer user_data) {
+	if(app_index) {
+		index_lookup(content_type, callback, user_data);
+		return;
+	}
+	struct IndexWaiter* waiter = g_new0(struct IndexWaiter, 1);
+	waiter->content_type = g_strdup(content_type);
+	waiter->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+	waiter->callback = callback;
+	waiter->user_data = user_data;
+	app_index_waiters = g_list_prepend(app_index_waiters, waiter);
+	if(!app_index_building)
+		mime_app_index_build();
 }
@@ -4,15 +4,38 @@
  * This file is part of Wemed. Wemed is licensed under the 
  * GNU GPL version 3. See LICENSE or <http://www.gnu.org/licenses/>
  * for more information */
- 
+#include <gio/gio.h>
+
 struct Application {
 	char* name;
 	char* exec;
 };
 
+// Returns the default application for a content type. Results are cached
+// until the installed applications change. Members must be free'd
 struct Application get_default_mime_app(const char* content_type);
 
+// An application from the desktop entry index
+struct MimeAppEntry {
+	char* name;
+	// command line with the file argument as %f, if it takes one
+	char* exec;
+	GIcon* icon;
+};
+
+typedef void (*MimeAppIndexCallback)(const struct MimeAppEntry* const* apps, guint n_apps, gpointer user_data);
+
+// Starts building the index of installed applications in the background.
+// Called at startup; the index is rebuilt when applications change
+void mime_app_index_build(void);
+
+// Calls callback with every application able to open the content type.
+// The entries are only valid during the callback. If the index is not
+// ready yet, the callback is deferred until it is (unless cancelled)
+void mime_app_index_lookup(const char* content_type, GCancellable* cancellable, MimeAppIndexCallback callback, gpointer user_data);
+
+// Returns the MIME type of a file (must be free'd). Safe to call from
+// any thread
 char* get_file_mime_type(const char* filename);
 
 #endif
-
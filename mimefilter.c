@@ -0,0 +1,87 @@
+/* Copyright 2022 Oliver Giles
+ * This file is part of Wemed. Wemed is licensed under the
+ * GNU GPL version 3. See LICENSE or <http://www.gnu.org/licenses/>
+ * for more information */
+#include <gmime/gmime.h>
+#include <string.h>
+#include "codec.h"
+#include "mimefilter.h"
+
+typedef struct {
+	GMimeFilter parent;
+	GMimeContentEncoding encoding;
+	gboolean encode;
+	struct Base64EncodeState base64_encode;
+	struct Base64DecodeState base64_decode;
+} WemedFilterBasic;
+
+typedef struct {
+	GMimeFilterClass parent_class;
+} WemedFilterBasicClass;
+
+G_DEFINE_TYPE(WemedFilterBasic, wemed_filter_basic, GMIME_TYPE_FILTER)
+
+static GMimeFilter* filter_copy(GMimeFilter* filter) {
+	WemedFilterBasic* f = (WemedFilterBasic*) filter;
+	return wemed_filter_basic_new(f->encoding, f->encode);
+}
+
+static void filter_run(GMimeFilter* filter, char* in, size_t len, char** out, size_t* outlen, size_t* outprespace, gboolean final) {
+	WemedFilterBasic* f = (WemedFilterBasic*) filter;
+	size_t n;
+	if(f->encoding == GMIME_CONTENT_ENCODING_BASE64 && f->encode) {
+		g_mime_filter_set_size(filter, codec_base64_encode_bound(len), FALSE);
+		n = codec_base64_encode_step((const unsigned char*) in, len, filter->outbuf, &f->base64_encode);
+		if(final)
+			n += codec_base64_encode_close(filter->outbuf + n, &f->base64_encode);
+	} else if(f->encoding == GMIME_CONTENT_ENCODING_BASE64) {
+		g_mime_filter_set_size(filter, codec_base64_decode_bound(len, &f->base64_decode), FALSE);
+		n = codec_base64_decode_step(in, len, (unsigned char*) filter->outbuf, &f->base64_decode);
+	} else {
+		// quoted-printable decoding. An escape split across two reads is
+		// saved and prepended to the next
+		size_t consumed;
+		g_mime_filter_set_size(filter, len + 1, FALSE);
+		n = codec_qp_decode_step(in, len, (unsigned char*) filter->outbuf, &consumed, final);
+		if(consumed < len)
+			g_mime_filter_backup(filter, in + consumed, len - consumed);
+	}
+	*out = filter->outbuf;
+	*outlen = n;
+	*outprespace = filter->outpre;
+}
+
+static void filter_filter(GMimeFilter* filter, char* in, size_t len, size_t prespace, char** out, size_t* outlen, size_t* outprespace) {
+	filter_run(filter, in, len, out, outlen, outprespace, FALSE);
+}
+
+static void filter_complete(GMimeFilter* filter, char* in, size_t len, size_t prespace, char** out, size_t* outlen, size_t* outprespace) {
+	filter_run(filter, in, len, out, outlen, outprespace, TRUE);
+}
+
+static void filter_reset(GMimeFilter* filter) {
+	WemedFilterBasic* f = (WemedFilterBasic*) filter;
+	memset(&f->base64_encode, 0, sizeof(f->base64_encode));
+	memset(&f->base64_decode, 0, sizeof(f->base64_decode));
+}
+
+static void wemed_filter_basic_class_init(WemedFilterBasicClass* class) {
+	GMimeFilterClass* filter_class = GMIME_FILTER_CLASS(class);
+	filter_class->copy = filter_copy;
+	filter_class->filter = filter_filter;
+	filter_class->complete = filter_complete;
+	filter_class->reset = filter_reset;
+}
+
+static void wemed_filter_basic_init(WemedFilterBasic* f) {
+}
+
+GMimeFilter* wemed_filter_basic_new(GMimeContentEncoding encoding, gboolean encode) {
+	if(encoding != GMIME_CONTENT_ENCODING_BASE64 && !(encoding == GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE && !encode))
+		return g_mime_filter_basic_new(encoding, encode);
+
+	WemedFilterBasic* f = g_object_new(wemed_filter_basic_get_type(), NULL);
+	f->encoding = encoding;
+	f->encode = encode;
+	return GMIME_FILTER(f);
+}
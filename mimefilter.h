@@ -0,0 +1,14 @@
+#ifndef MIMEFILTER_H
+#define MIMEFILTER_H
+/* Copyright 2022 Oliver Giles
+ * This file is part of Wemed. Wemed is licensed under the
+ * GNU GPL version 3. See LICENSE or <http://www.gnu.org/licenses/>
+ * for more information */
+#include <gmime/gmime.h>
+
+// A replacement for g_mime_filter_basic_new which uses the SIMD codecs
+// from codec.c for base64 and for quoted-printable decoding, and GMime's
+// own filter for everything else
+GMimeFilter* wemed_filter_basic_new(GMimeContentEncoding encoding, gboolean encode);
+
+#endif
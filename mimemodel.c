@@ -5,12 +5,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <gtk/gtk.h>
 #include <gmime/gmime.h>
 #include <string.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include "mimemodel.h"
 #include "mimeapp.h"
+#include "mimefilter.h"
 
 struct _MimeModelClass {
 	GObjectClass base;
@@ -21,7 +26,68 @@ struct _MimeModel {
 	GtkTreeStore* store;
 	GtkTreeModel* filter;
 	GMimeObject* message;
+	// the stream the document was parsed from. Unmodified parts are
+	// views onto it, so it has to outlive them
+	GMimeStream* source;
 	gboolean filter_enabled;
+	// GMimeObject* -> GtkTreeIter* of the row displaying it. GtkTreeStore
+	// iters persist for the lifetime of their row, so this is kept in sync
+	// by add_part_to_store and forget_rows rather than scanning the store
+	GHashTable* rows;
+	// GMimeObject* -> generation, bumped whenever the content or headers
+	// of a part change. Parts which were never modified are absent (0)
+	GHashTable* generations;
+	// GMimeObject* -> struct SourceRange* for parts parsed from source
+	GHashTable* ranges;
+	// Content-ID -> struct ContentIdEntry*, for resolving cid: references
+	// without walking the tree. Maintained by add_part_to_store and
+	// forget_part along with content_ids: GMimeObject* -> the Content-ID
+	// it is indexed under
+	GHashTable* by_content_id;
+	GHashTable* content_ids;
+	// decoded content of recently displayed parts
+	struct {
+		GHashTable* entries; // GMimeObject* -> struct CacheEntry*
+		GQueue lru; // most recently used at the head
+		gsize size;
+		guint hits;
+		guint misses;
+	} cache;
+};
+
+// upper bound on the total size of decoded content kept in the cache
+#define CONTENT_CACHE_BUDGET (64 * 1024 * 1024)
+
+// Where a parsed part is in the source stream, so that saving can copy it
+// verbatim unless it has been modified
+struct SourceRange {
+	gint64 start; // the first header
+	gint64 body; // after the blank line ending the headers
+	gint64 end; // the end of the content, for leaf parts
+	int n_children; // for multiparts
+	// for multiparts, where the line with the closing boundary starts.
+	// Only looked up when needed: 0 if not yet, -1 if it wasn't found
+	gint64 close;
+	guint modified; // RANGE_* flags
+};
+
+#define RANGE_HEADERS_MODIFIED 1
+#define RANGE_CONTENT_MODIFIED 2
+// the object was rebuilt from new headers; its type, boundary or
+// transfer encoding may differ from the source
+#define RANGE_REPLACED 4
+
+struct ContentIdEntry {
+	// if several parts share a Content-ID, the first one indexed
+	GMimeObject* part;
+	guint count;
+};
+
+struct CacheEntry {
+	GMimeObject* part;
+	guint generation;
+	GBytes* content;
+	GList link;
 };
 
 G_DEFINE_TYPE(MimeModel, mime_model, G_TYPE_OBJECT)
@@ -48,6 +114,234 @@ static void mime_model_class_init(MimeModelClass* class) {
 	      G_TYPE_POINTER); // arg types
 }
 
+static void cache_entry_free(MimeModel* m, struct CacheEntry* e) {
+	g_queue_unlink(&m->cache.lru, &e->link);
+	m->cache.size -= g_bytes_get_size(e->content);
+	g_bytes_unref(e->content);
+	g_free(e);
+}
+
+static void cache_remove(MimeModel* m, GMimeObject* part) {
+	struct CacheEntry* e = g_hash_table_lookup(m->cache.entries, part);
+	if(e) {
+		g_hash_table_remove(m->cache.entries, part);
+		cache_entry_free(m, e);
+	}
+}
+
+static void cache_insert(MimeModel* m, GMimeObject* part, guint generation, GBytes* content) {
+	gsize size = g_bytes_get_size(content);
+	if(size > CONTENT_CACHE_BUDGET / 4)
+		return; // not worth evicting everything else for
+	cache_remove(m, part);
+	while(m->cache.size + size > CONTENT_CACHE_BUDGET) {
+		struct CacheEntry* oldest = g_queue_peek_tail(&m->cache.lru);
+		g_hash_table_remove(m->cache.entries, oldest->part);
+		cache_entry_free(m, oldest);
+	}
+	struct CacheEntry* e = g_new0(struct CacheEntry, 1);
+	e->part = part;
+	e->generation = generation;
+	e->content = g_bytes_ref(content);
+	e->link.data = e;
+	g_queue_push_head_link(&m->cache.lru, &e->link);
+	g_hash_table_insert(m->cache.entries, part, e);
+	m->cache.size += size;
+}
+
+static GBytes* cache_lookup(MimeModel* m, GMimeObject* part) {
+	struct CacheEntry* e = g_hash_table_lookup(m->cache.entries, part);
+	if(e && e->generation == GPOINTER_TO_UINT(g_hash_table_lookup(m->generations, part))) {
+		m->cache.hits++;
+		g_queue_unlink(&m->cache.lru, &e->link);
+		g_queue_push_head_link(&m->cache.lru, &e->link);
+		return g_bytes_ref(e->content);
+	}
+	m->cache.misses++;
+	return NULL;
+}
+
+// called when the content or headers of a part have changed
+static void bump_generation(MimeModel* m, GMimeObject* part) {
+	guint gen = GPOINTER_TO_UINT(g_hash_table_lookup(m->generations, part));
+	g_hash_table_insert(m->generations, part, GUINT_TO_POINTER(gen + 1));
+	cache_remove(m, part);
+}
+
+// drops part from the Content-ID index. If another part shares its
+// Content-ID, lookups find that one instead
+static void unindex_content_id(MimeModel* m, GMimeObject* part) {
+	const char* cid = g_hash_table_lookup(m->content_ids, part);
+	if(cid == NULL)
+		return;
+	struct ContentIdEntry* e = g_hash_table_lookup(m->by_content_id, cid);
+	if(--e->count == 0) {
+		g_hash_table_remove(m->by_content_id, cid);
+	} else if(e->part == part) {
+		// another part has the same Content-ID; it takes over
+		GHashTableIter it;
+		gpointer other, other_cid;
+		g_hash_table_iter_init(&it, m->content_ids);
+		while(g_hash_table_iter_next(&it, &other, &other_cid)) {
+			if(other != part && strcmp(other_cid, cid) == 0) {
+				e->part = other;
+				break;
+			}
+		}
+	}
+	g_hash_table_remove(m->content_ids, part);
+}
+
+// (re)indexes part under its current Content-ID
+static void index_content_id(MimeModel* m, GMimeObject* part) {
+	unindex_content_id(m, part);
+	const char* cid = g_mime_object_get_content_id(part);
+	if(cid == NULL)
+		return;
+	char* key = g_strdup(cid);
+	struct ContentIdEntry* e = g_hash_table_lookup(m->by_content_id, key);
+	if(e == NULL) {
+		e = g_new0(struct ContentIdEntry, 1);
+		e->part = part;
+		g_hash_table_insert(m->by_content_id, g_strdup(key), e);
+	}
+	e->count++;
+	g_hash_table_insert(m->content_ids, part, key);
+}
+
+// called when a part leaves the tree. Its address may be reused by a
+// new part, so nothing keyed on it may survive
+static void forget_part(MimeModel* m, GMimeObject* part) {
+	unindex_content_id(m, part);
+	g_hash_table_remove(m->rows, part);
+	g_hash_table_remove(m->generations, part);
+	g_hash_table_remove(m->ranges, part);
+	cache_remove(m, part);
+}
+
+// set on parts whose content is a file on disk rather than part of the
+// document
+#define FILE_PATH_KEY "wemed-file-path"
+
+// A stream over the content of part with its own position, so it can be
+// read without disturbing other readers, including other threads. *parent
+// receives a reference keeping the backing store alive, or NULL
+static GMimeStream* content_view(GMimePart* part, GMimeStream** parent) {
+	*parent = NULL;
+	const char* path = g_object_get_data(G_OBJECT(part), FILE_PATH_KEY);
+	if(path) {
+		// substreams of a file stream would share its descriptor's offset
+		int fd = open(path, O_RDONLY);
+		if(fd < 0) {
+			fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+			return NULL;
+		}
+		return g_mime_stream_fs_new(fd);
+	}
+	GMimeStream* source = g_mime_data_wrapper_get_stream(g_mime_part_get_content(part));
+	if(GMIME_IS_STREAM_FS(source)) {
+		// the document is read from a file stream when it couldn't be
+		// mapped, and those substreams share its descriptor too. Reopening
+		// through /proc gives a descriptor with an offset of its own
+		char proc_path[32];
+		snprintf(proc_path, sizeof proc_path, "/proc/self/fd/%d", GMIME_STREAM_FS(source)->fd);
+		int fd = open(proc_path, O_RDONLY | O_CLOEXEC);
+		if(fd < 0) {
+			fprintf(stderr, "Could not reopen document: %s\n", strerror(errno));
+			return NULL;
+		}
+		return g_mime_stream_fs_new_with_bounds(fd, source->bound_start, source->bound_end);
+	}
+	*parent = g_object_ref(source);
+	return g_mime_stream_substream(source, source->bound_start, source->bound_end);
+}
+
+static void mark_modified(MimeModel* m, GMimeObject* part, guint flags) {
+	struct SourceRange* r = g_hash_table_lookup(m->ranges, part);
+	if(r)
+		r->modified |= flags;
+}
+
+// returns the offset just after the blank line which ends the headers
+// starting at from, or -1
+static gint64 find_headers_end(GMimeStream* source, gint64 from) {
+	if(g_mime_stream_seek(source, from, GMIME_STREAM_SEEK_SET) < 0)
+		return -1;
+	char buf[4096];
+	gboolean line_start = TRUE;
+	gint64 pos = from;
+	ssize_t n;
+	while((n = g_mime_stream_read(source, buf, sizeof(buf))) > 0) {
+		for(ssize_t i = 0; i < n; ++i, ++pos) {
+			if(buf[i] == '\n') {
+				if(line_start)
+					return pos + 1;
+				line_start = TRUE;
+			} else if(buf[i] != '\r') {
+				line_start = FALSE;
+			}
+		}
+	}
+	return -1;
+}
+
+static void record_ranges(MimeModel* m, GMimeObject* obj) {
+	GMimeHeaderList* headers = g_mime_object_get_header_list(obj);
+	if(g_mime_header_list_get_count(headers) == 0)
+		return;
+	struct SourceRange* r = g_new0(struct SourceRange, 1);
+	r->start = g_mime_header_get_offset(g_mime_header_list_get_header_at(headers, 0));
+	r->body = find_headers_end(m->source, r->start);
+	if(r->start < 0 || r->body < 0) {
+		g_free(r);
+		return;
+	}
+	r->end = r->body;
+	if(GMIME_IS_MULTIPART(obj)) {
+		r->n_children = g_mime_multipart_get_count(GMIME_MULTIPART(obj));
+		for(int i = 0; i < r->n_children; ++i)
+			record_ranges(m, g_mime_multipart_get_part(GMIME_MULTIPART(obj), i));
+	} else if(GMIME_IS_PART(obj) && g_mime_part_get_content(GMIME_PART(obj))) {
+		// with a persistent parser, the content is a view onto the source
+		r->end = g_mime_data_wrapper_get_stream(g_mime_part_get_content(GMIME_PART(obj)))->bound_end;
+	}
+	g_hash_table_insert(m->ranges, obj, r);
+}
+
+// content type -> GdkPixbuf* (NULL if the theme has none), shared by every
+// row and every model so each distinct type is only loaded once
+static GHashTable* icon_cache;
+
+static void icon_cache_value_free(gpointer icon) {
+	if(icon)
+		g_object_unref(icon);
+}
+
+static void icon_theme_changed(GtkIconTheme* theme, gpointer user_data) {
+	g_hash_table_remove_all(icon_cache);
+}
+
+// returns a borrowed reference, or NULL
+static GdkPixbuf* icon_for_content_type(const char* content_type) {
+	if(!icon_cache) {
+		icon_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, icon_cache_value_free);
+		g_signal_connect(gtk_icon_theme_get_default(), "changed", G_CALLBACK(icon_theme_changed), NULL);
+	}
+
+	gpointer icon = NULL;
+	if(!g_hash_table_lookup_extended(icon_cache, content_type, NULL, &icon)) {
+		GIcon* gicon = g_content_type_get_icon(content_type);
+		GtkIconInfo *icon_info = gtk_icon_theme_lookup_by_gicon(gtk_icon_theme_get_default(), gicon, 16, 0);
+		g_object_unref(gicon);
+		if(icon_info) {
+			icon = gtk_icon_info_load_icon(icon_info, NULL);
+			g_object_unref(icon_info);
+		}
+		g_hash_table_insert(icon_cache, g_strdup(content_type), icon);
+	}
+	return icon;
+}
+
 static void add_part_to_store(MimeModel* m, GtkTreeIter* iter, GMimeObject* part) {
 	GdkPixbuf* icon = NULL;
 	char* name;
@@ -62,13 +356,7 @@ static void add_part_to_store(MimeModel* m, GtkTreeIter* iter, GMimeObject* part
 		icon_name = strdup("package");
 	}
 
-	GIcon* gicon = g_content_type_get_icon(icon_name);
-	GtkIconInfo *icon_info = gtk_icon_theme_lookup_by_gicon(gtk_icon_theme_get_default(), gicon, 16, 0);
-	g_object_unref(gicon);
-	if(icon_info) {
-		icon = gtk_icon_info_load_icon(icon_info, NULL);
-		g_object_unref(icon_info);
-	}
+	icon = icon_for_content_type(icon_name);
 
 	// add to tree
 	gtk_tree_store_set(m->store, iter,
@@ -77,36 +365,35 @@ static void add_part_to_store(MimeModel* m, GtkTreeIter* iter, GMimeObject* part
 	                   MIME_MODEL_COL_NAME, name,
 	                   -1);
 
-	if(icon)
-		g_object_unref(icon);
-
 	free(icon_name);
 	free(name);
-}
 
-// At present it seems the only way to get a GtkTreeIter from
-// a GMimeObject* is a brute-force match...
-struct PartFinder {
-	GtkTreeIter iter;
-	GMimeObject* obj;
-};
+	// (re)index the row. Any previous object at this row must have been
+	// forgotten by the caller
+	g_hash_table_insert(m->rows, part, gtk_tree_iter_copy(iter));
+	index_content_id(m, part);
+}
 
-static gboolean find_part(GtkTreeModel* model, GtkTreePath* path, GtkTreeIter* iter, void* user_data) {
-	struct PartFinder* p = (struct PartFinder*) user_data;
-	GMimeObject* obj = NULL;
-	gtk_tree_model_get(model, iter, MIME_MODEL_COL_OBJECT, &obj, -1);
-	if(obj == p->obj) {
-		p->iter = *iter;
-		return TRUE;
+// drop the index entries for a row and all its descendants
+static void forget_rows(MimeModel* m, GtkTreeIter* iter) {
+	GtkTreeIter child;
+	if(gtk_tree_model_iter_children(GTK_TREE_MODEL(m->store), &child, iter)) {
+		do {
+			forget_rows(m, &child);
+		} while(gtk_tree_model_iter_next(GTK_TREE_MODEL(m->store), &child));
 	}
-	return FALSE;
+	GMimeObject* obj = NULL;
+	gtk_tree_model_get(GTK_TREE_MODEL(m->store), iter, MIME_MODEL_COL_OBJECT, &obj, -1);
+	forget_part(m, obj);
 }
 
+// Returns the row of the given object, or an iter with a zero stamp
+// if the object is not in the tree
 static GtkTreeIter iter_from_obj(MimeModel* m, GMimeObject* part) {
-	struct PartFinder p;
-	p.obj = part;
-	gtk_tree_model_foreach(GTK_TREE_MODEL(m->store), find_part, &p);
-	return p.iter;
+	GtkTreeIter* iter = g_hash_table_lookup(m->rows, part);
+	if(iter)
+		return *iter;
+	return (GtkTreeIter) {0};
 }
 
 static GMimeObject* obj_from_iter(MimeModel* m, GtkTreeIter iter) {
@@ -115,9 +402,11 @@ static GMimeObject* obj_from_iter(MimeModel* m, GtkTreeIter iter) {
 	return GMIME_OBJECT(g_value_get_pointer(&v));
 }
 
+// GtkTreeStore keeps a parent pointer per row, so this is constant-time
 static GtkTreeIter parent_node(MimeModel* m, GtkTreeIter child) {
-	GtkTreeIter parent;
-	gtk_tree_model_iter_parent(GTK_TREE_MODEL(m->store), &parent, &child);
+	GtkTreeIter parent = {0};
+	if(child.stamp == 0 || !gtk_tree_model_iter_parent(GTK_TREE_MODEL(m->store), &parent, &child))
+		parent.stamp = 0;
 	return parent;
 }
 
@@ -182,7 +471,7 @@ void mime_model_update_content(MimeModel* m, GMimePart* part, GString content) {
 	GMimeStream* encoded_content = g_mime_stream_mem_new();
 	{
 		GMimeStream* content_stream = g_mime_stream_mem_new_with_buffer(content.str, content.len);
-		GMimeFilter* basic_filter = g_mime_filter_basic_new(g_mime_part_get_content_encoding(part), TRUE);
+		GMimeFilter* basic_filter = wemed_filter_basic_new(g_mime_part_get_content_encoding(part), TRUE);
 		GMimeStream* stream_filter = g_mime_stream_filter_new(content_stream);
 		g_mime_stream_filter_add(GMIME_STREAM_FILTER(stream_filter), basic_filter);
 		g_mime_stream_write_to_stream(stream_filter, encoded_content);
@@ -194,6 +483,28 @@ void mime_model_update_content(MimeModel* m, GMimePart* part, GString content) {
 	g_mime_part_set_content(GMIME_PART(part), data);
 	g_object_unref(encoded_content);
 	g_object_unref(data);
+	g_object_set_data(G_OBJECT(part), FILE_PATH_KEY, NULL);
+	bump_generation(m, GMIME_OBJECT(part));
+	mark_modified(m, GMIME_OBJECT(part), RANGE_CONTENT_MODIFIED);
+}
+
+gboolean mime_model_set_part_file(MimeModel* m, GMimePart* part, const char* filename) {
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+		return FALSE;
+	}
+	// the file is stored unencoded; GMime applies the part's transfer
+	// encoding as it writes the part
+	GMimeStream* stream = g_mime_stream_fs_new(fd);
+	GMimeDataWrapper* data = g_mime_data_wrapper_new_with_stream(stream, GMIME_CONTENT_ENCODING_DEFAULT);
+	g_mime_part_set_content(part, data);
+	g_object_unref(stream);
+	g_object_unref(data);
+	g_object_set_data_full(G_OBJECT(part), FILE_PATH_KEY, g_strdup(filename), g_free);
+	bump_generation(m, GMIME_OBJECT(part));
+	mark_modified(m, GMIME_OBJECT(part), RANGE_CONTENT_MODIFIED);
+	return TRUE;
 }
 
 void mime_model_part_replace(MimeModel* m, GMimeObject* part_old, GMimeObject* part_new) {
@@ -208,48 +519,99 @@ void mime_model_part_replace(MimeModel* m, GMimeObject* part_old, GMimeObject* p
 		int index = g_mime_multipart_index_of(multipart, part_old);
 		g_mime_multipart_replace(multipart, index, part_new); // already have this
 	}
+	// the new part takes the old one's place in the source
+	struct SourceRange* r = g_hash_table_lookup(m->ranges, part_old);
+	if(r) {
+		g_hash_table_steal(m->ranges, part_old);
+		r->modified |= RANGE_REPLACED;
+		g_hash_table_insert(m->ranges, part_new, r);
+	}
+	forget_part(m, part_old);
 	g_object_unref(part_old);
 	add_part_to_store(m, &it, part_new);
 }
 
-// changing the header can have large consequences; this function
-// just creates a new part based on the new header and the old contents
+// Applies an edited header block to part without rebuilding it. Only
+// possible when the edit doesn't change what kind of part this is or how
+// its content is stored; returns FALSE otherwise
+static gboolean update_header_in_place(MimeModel* m, GMimeObject* part, GMimeObject* parsed) {
+	if(G_OBJECT_TYPE(parsed) != G_OBJECT_TYPE(part))
+		return FALSE;
+	if(g_strcmp0(g_mime_object_get_header(parsed, "Content-Type"), g_mime_object_get_header(part, "Content-Type")) != 0)
+		return FALSE;
+	if(g_strcmp0(g_mime_object_get_header(parsed, "Content-Transfer-Encoding"), g_mime_object_get_header(part, "Content-Transfer-Encoding")) != 0)
+		return FALSE;
+
+	GMimeHeaderList* old_list = g_mime_object_get_header_list(part);
+	GMimeHeaderList* new_list = g_mime_object_get_header_list(parsed);
+	int n = g_mime_header_list_get_count(new_list);
+	gboolean same_names = (n == g_mime_header_list_get_count(old_list));
+	for(int i = 0; same_names && i < n; ++i) {
+		const char* old_name = g_mime_header_get_name(g_mime_header_list_get_header_at(old_list, i));
+		const char* new_name = g_mime_header_get_name(g_mime_header_list_get_header_at(new_list, i));
+		same_names = g_ascii_strcasecmp(old_name, new_name) == 0;
+	}
+
+	if(same_names) {
+		// the common case of editing values: only touch what changed
+		for(int i = 0; i < n; ++i) {
+			GMimeHeader* old_header = g_mime_header_list_get_header_at(old_list, i);
+			const char* raw = g_mime_header_get_raw_value(g_mime_header_list_get_header_at(new_list, i));
+			if(raw && g_strcmp0(raw, g_mime_header_get_raw_value(old_header)) != 0)
+				g_mime_header_set_raw_value(old_header, raw);
+		}
+	} else {
+		// headers were added, removed or reordered
+		g_mime_header_list_clear(old_list);
+		for(int i = 0; i < n; ++i) {
+			GMimeHeader* h = g_mime_header_list_get_header_at(new_list, i);
+			g_mime_object_append_header(part, g_mime_header_get_raw_name(h), g_mime_header_get_value(h), NULL);
+			// keep the text exactly as the user wrote it
+			const char* raw = g_mime_header_get_raw_value(h);
+			if(raw)
+				g_mime_header_set_raw_value(g_mime_header_list_get_header_at(old_list, i), raw);
+		}
+	}
+
+	mark_modified(m, part, RANGE_HEADERS_MODIFIED);
+
+	// the filename shown in the tree may have changed
+	GtkTreeIter it = iter_from_obj(m, part);
+	add_part_to_store(m, &it, part);
+	return TRUE;
+}
+
+// changing the header can have large consequences. Where the content isn't
+// affected the header is updated in place and the same part is returned,
+// otherwise this creates a new part based on the new header and the old contents
 GMimeObject* mime_model_update_header(MimeModel* m, GMimeObject* part_old, GString new_header) {
 	GMimeStream* memstream = g_mime_stream_mem_new_with_buffer(new_header.str, new_header.len);
 	GMimeParser* parse = g_mime_parser_new_with_stream(memstream);
 	GMimeObject* part_new = g_mime_parser_construct_part(parse, g_mime_parser_options_get_default());
+	g_object_unref(parse);
+	g_object_unref(memstream);
 	if(!part_new)
 		return NULL;
 
+	if(update_header_in_place(m, part_old, part_new)) {
+		g_object_unref(part_new);
+		return part_old;
+	}
+
 	// if, for example, the user attempts to change a multipart
 	// object into a part object, fail
-	if(G_OBJECT_TYPE(part_new) != G_OBJECT_TYPE(part_old))
+	if(G_OBJECT_TYPE(part_new) != G_OBJECT_TYPE(part_old)) {
+		g_object_unref(part_new);
 		return NULL;
+	}
 
+	bump_generation(m, part_old);
 	if(GMIME_IS_PART(part_new)) {
-		// set the content object of the new part to the old part
-		GMimeContentEncoding enc_old = g_mime_part_get_content_encoding(GMIME_PART(part_old));
-		GMimeContentEncoding enc_new = g_mime_part_get_content_encoding(GMIME_PART(part_new));
-		if(enc_old != enc_new) {
-			GMimeStream* new_data = g_mime_stream_mem_new();
-			GMimeFilter* decode = g_mime_filter_basic_new(enc_old, FALSE);
-			GMimeFilter* encode = g_mime_filter_basic_new(enc_new, TRUE);
-			GMimeStream* original = g_mime_data_wrapper_get_stream(g_mime_part_get_content(GMIME_PART(part_old)));
-			g_mime_stream_reset(original);
-			GMimeStream* filter = g_mime_stream_filter_new(original);
-			g_mime_stream_filter_add(GMIME_STREAM_FILTER(filter), decode);
-			g_mime_stream_filter_add(GMIME_STREAM_FILTER(filter), encode);
-			g_mime_stream_write_to_stream(filter, new_data);
-			g_mime_stream_reset(new_data);
-			GMimeDataWrapper* wrapper = g_mime_data_wrapper_new_with_stream(new_data, enc_new);
-			g_mime_part_set_content(GMIME_PART(part_new), wrapper);
-			g_object_unref(new_data);
-			g_object_unref(decode);
-			g_object_unref(encode);
-			g_object_unref(filter);
-			g_object_unref(wrapper);
-		} else
-			g_mime_part_set_content(GMIME_PART(part_new), g_mime_part_get_content(GMIME_PART(part_old)));
+		// set the content object of the new part to the old part. If the
+		// transfer encoding has changed, the wrapper keeps its original
+		// encoding and GMime transcodes it when the part is written, streaming
+		// straight to the output rather than through a copy in memory
+		g_mime_part_set_content(GMIME_PART(part_new), g_mime_part_get_content(GMIME_PART(part_old)));
 	} else if(GMIME_IS_MULTIPART(part_new)) {
 		// move all the mime parts from the old multipart to the new multipart
 		for(int i = 0, n = g_mime_multipart_get_count(GMIME_MULTIPART(part_old)); i < n; ++i) {
@@ -328,18 +690,29 @@ GMimeObject* mime_model_new_node(MimeModel* m, GMimeObject* parent_or_sibling, c
 	return new_node;
 }
 
-MimeModel* mime_model_new(GString content) {
-	MimeModel* m = g_object_new(mime_model_get_type(), NULL);
-
-	if(content.str) {
-		GMimeStream* gfs = g_mime_stream_mem_new_with_buffer(content.str, content.len);
-		GMimeParser* parser = g_mime_parser_new_with_stream(gfs);
+MimeModel* mime_model_new(GMimeStream* source) {
+	GMimeObject* root;
+	if(source) {
+		GMimeParser* parser = g_mime_parser_new_with_stream(source);
+		// parts reference ranges of the source rather than copies of it
+		g_mime_parser_set_persist_stream(parser, TRUE);
 		GMimeMessage* message = g_mime_parser_construct_message(parser, g_mime_parser_options_get_default());
-		m->message = g_mime_message_get_mime_part(message);
+		g_object_unref(parser);
+		root = message ? g_mime_message_get_mime_part(message) : NULL;
+		if(root == NULL) {
+			fprintf(stderr, "Failed to parse message\n");
+			return NULL;
+		}
 	} else {
-		m->message = (GMimeObject*) g_mime_multipart_new();
+		root = (GMimeObject*) g_mime_multipart_new();
 	}
 
+	MimeModel* m = g_object_new(mime_model_get_type(), NULL);
+	m->message = root;
+	m->source = source ? g_object_ref(source) : NULL;
+	if(m->source)
+		record_ranges(m, m->message);
+
 	struct TreeInsertHelper h = {0};
 	h.m = m;
 	gtk_tree_store_append(m->store, &h.parent, NULL);
@@ -358,6 +731,13 @@ void mime_model_init(MimeModel* m) {
 
 	gtk_tree_model_filter_set_visible_func(GTK_TREE_MODEL_FILTER(m->filter), is_content_disposition_inline, m, NULL);
 	m->filter_enabled = FALSE;
+	m->rows = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) gtk_tree_iter_free);
+	m->generations = g_hash_table_new(g_direct_hash, g_direct_equal);
+	m->ranges = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	m->by_content_id = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	m->content_ids = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	m->cache.entries = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_queue_init(&m->cache.lru);
 }
 
 GtkTreeModel* mime_model_get_gtk_model(MimeModel* m) {
@@ -368,6 +748,10 @@ GMimeObject* mime_model_root(MimeModel* m) {
 	return m->message;
 }
 
+gboolean mime_model_contains(MimeModel* m, GMimeObject* obj) {
+	return g_hash_table_contains(m->rows, obj);
+}
+
 void mime_model_filter_inline(MimeModel* m, gboolean en) {
 	m->filter_enabled = en;
 	gtk_tree_model_filter_refilter(GTK_TREE_MODEL_FILTER(m->filter));
@@ -379,76 +763,463 @@ char* mime_model_content_type(GMimeObject* obj) {
 }
 
 
-void mime_model_write_part(GMimePart* part, FILE* fp) {
-	GMimeStream* gms = g_mime_data_wrapper_get_stream(g_mime_part_get_content(part));
-	g_mime_stream_reset(gms);
-	GMimeFilter* basic_filter = g_mime_filter_basic_new(g_mime_part_get_content_encoding(part), FALSE);
-	GMimeStream* stream_filter = g_mime_stream_filter_new(gms);
+static GMimeStream* decoding_stream(GMimeStream* view, GMimeContentEncoding encoding) {
+	GMimeStream* stream_filter = g_mime_stream_filter_new(view);
+	GMimeFilter* basic_filter = wemed_filter_basic_new(encoding, FALSE);
 	g_mime_stream_filter_add(GMIME_STREAM_FILTER(stream_filter), basic_filter);
+	g_object_unref(basic_filter);
+	return stream_filter;
+}
+
+gboolean mime_model_write_part(GMimePart* part, FILE* fp) {
+	GMimeDataWrapper* wrapper = g_mime_part_get_content(part);
+	if(wrapper == NULL)
+		return TRUE;
+	GMimeStream* parent;
+	GMimeStream* view = content_view(part, &parent);
+	if(view == NULL)
+		return FALSE;
+	GMimeStream* decoded = decoding_stream(view, g_mime_data_wrapper_get_encoding(wrapper));
 	GMimeStream* filestream = g_mime_stream_file_new(fp);
-	g_mime_stream_write_to_stream(stream_filter, filestream);
-	fflush(fp);
-	g_mime_stream_reset(gms);
+	g_mime_stream_file_set_owner(GMIME_STREAM_FILE(filestream), FALSE);
+	gboolean ok = g_mime_stream_write_to_stream(decoded, filestream) != -1 && g_mime_stream_flush(filestream) == 0;
 	g_object_unref(filestream);
+	g_object_unref(decoded);
+	g_object_unref(view);
+	if(parent)
+		g_object_unref(parent);
+	return ok;
+}
+
+static gboolean write_all(int fd, const char* buf, size_t len) {
+	while(len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0)
+			return FALSE;
+		buf += n;
+		len -= n;
+	}
+	return TRUE;
 }
 
-gboolean mime_model_write_to_file(MimeModel* m, FILE* fp) {
+// Copies the range [start, end) of in_fd to out_fd within the kernel.
+// Returns 1 on success, 0 on failure and -1 if the kernel can't copy
+// between these files, before anything was written
+static int copy_range(int in_fd, off_t start, off_t end, int out_fd, GCancellable* cancellable) {
+	off_t off = start;
+	gboolean use_sendfile = FALSE;
+	while(off < end) {
+		if(g_cancellable_is_cancelled(cancellable))
+			return 0;
+		size_t chunk = MIN(end - off, 8 * 1024 * 1024);
+		ssize_t n = use_sendfile ? sendfile(out_fd, in_fd, &off, chunk) : copy_file_range(in_fd, &off, out_fd, NULL, chunk, 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && off == start && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+			if(use_sendfile)
+				return -1;
+			use_sendfile = TRUE;
+			continue;
+		}
+		if(n <= 0)
+			return 0;
+	}
+	return 1;
+}
+
+// the descriptor behind a view of the source or of an imported file
+static int view_fd(GMimeStream* view) {
+	if(GMIME_IS_STREAM_MMAP(view))
+		return GMIME_STREAM_MMAP(view)->fd;
+	if(GMIME_IS_STREAM_FS(view))
+		return GMIME_STREAM_FS(view)->fd;
+	return -1;
+}
+
+static gboolean export_content(GMimePart* part, int fd, GCancellable* cancellable) {
+	GMimeDataWrapper* wrapper = g_mime_part_get_content(part);
+	if(wrapper == NULL)
+		return TRUE;
+	GMimeStream* parent;
+	GMimeStream* view = content_view(part, &parent);
+	if(view == NULL)
+		return FALSE;
+
+	int ret = -1;
+	switch(g_mime_data_wrapper_get_encoding(wrapper)) {
+	case GMIME_CONTENT_ENCODING_DEFAULT:
+	case GMIME_CONTENT_ENCODING_7BIT:
+	case GMIME_CONTENT_ENCODING_8BIT:
+	case GMIME_CONTENT_ENCODING_BINARY:
+		// nothing to decode, so the bytes needn't pass through here at all
+		if(view_fd(view) >= 0) {
+			off_t end = view->bound_end;
+			struct stat st;
+			if(end < 0 && fstat(view_fd(view), &st) == 0)
+				end = st.st_size;
+			if(end >= 0)
+				ret = copy_range(view_fd(view), view->bound_start, end, fd, cancellable);
+		}
+		break;
+	default:
+		break;
+	}
+	if(ret == -1) {
+		GMimeStream* decoded = decoding_stream(view, g_mime_data_wrapper_get_encoding(wrapper));
+		char buf[65536];
+		ssize_t n = 0;
+		ret = 1;
+		while(ret && (n = g_mime_stream_read(decoded, buf, sizeof(buf))) > 0) {
+			if(g_cancellable_is_cancelled(cancellable) || !write_all(fd, buf, n))
+				ret = 0;
+		}
+		if(ret && n < 0)
+			ret = 0;
+		g_object_unref(decoded);
+	}
+	g_object_unref(view);
+	if(parent)
+		g_object_unref(parent);
+	return ret == 1;
+}
+
+// GMime writes a message from the content streams of its parts, not
+// through content_view. When the document is read through a file stream
+// rather than mapped, those all share the document's descriptor and so
+// its offset, so only one message is written at a time
+G_LOCK_DEFINE_STATIC(message_export);
+
+gboolean mime_model_export_part(GMimeObject* part, int fd, GCancellable* cancellable) {
+	if(GMIME_IS_PART(part))
+		return export_content(GMIME_PART(part), fd, cancellable);
+	if(GMIME_IS_MESSAGE_PART(part)) {
+		GMimeMessage* message = g_mime_message_part_get_message(GMIME_MESSAGE_PART(part));
+		if(message == NULL)
+			return TRUE;
+		GMimeStream* out = g_mime_stream_fs_new(fd);
+		g_mime_stream_fs_set_owner(GMIME_STREAM_FS(out), FALSE);
+		G_LOCK(message_export);
+		gboolean ok = g_mime_object_write_to_stream(GMIME_OBJECT(message), g_mime_format_options_get_default(), out) != -1;
+		G_UNLOCK(message_export);
+		g_object_unref(out);
+		return ok;
+	}
+	return FALSE;
+}
+
+// returns the offset of the line "--boundary--" closing a multipart, the
+// first found after from, or -1
+static gint64 find_closing_boundary(GMimeStream* source, gint64 from, const char* boundary) {
+	if(g_mime_stream_seek(source, from, GMIME_STREAM_SEEK_SET) < 0)
+		return -1;
+	char* needle = g_strdup_printf("\n--%s--", boundary);
+	size_t needle_len = strlen(needle);
+	char buf[65536];
+	size_t have = 0;
+	gint64 base = from; // the offset of buf[0]
+	gint64 found = -1;
+	ssize_t n;
+	while((n = g_mime_stream_read(source, buf + have, sizeof(buf) - have)) > 0) {
+		have += n;
+		const char* hit = memmem(buf, have, needle, needle_len);
+		if(hit) {
+			found = base + (hit - buf) + 1;
+			break;
+		}
+		// keep enough to match the boundary if it straddles two reads
+		size_t keep = MIN(have, needle_len - 1);
+		memmove(buf, buf + have - keep, keep);
+		base += have - keep;
+		have = keep;
+	}
+	g_free(needle);
+	return found;
+}
+
+// Where the closing boundary of mp is in the source. Found by searching
+// from its last original child, which for a leaf ends just before it
+static gint64 closing_boundary(MimeModel* m, GMimeMultipart* mp) {
+	struct SourceRange* r = g_hash_table_lookup(m->ranges, mp);
+	if(r->close)
+		return r->close;
+	r->close = -1;
+	GMimeObject* last = NULL;
+	struct SourceRange* last_range = NULL;
+	for(int i = g_mime_multipart_get_count(mp) - 1; i >= 0 && !last_range; --i) {
+		last = g_mime_multipart_get_part(mp, i);
+		last_range = g_hash_table_lookup(m->ranges, last);
+	}
+	if(last_range == NULL)
+		return -1;
+	gint64 from = last_range->start;
+	if(GMIME_IS_PART(last))
+		from = last_range->end;
+	else if(GMIME_IS_MULTIPART(last) && closing_boundary(m, GMIME_MULTIPART(last)) > 0)
+		from = last_range->close;
+	// the content of a leaf may or may not end with the line break
+	r->close = find_closing_boundary(m->source, MAX(from - 1, 0), g_mime_multipart_get_boundary(mp));
+	return r->close;
+}
+
+// Whether obj can be written by splicing. The ranges of the parts have to
+// be in source order, and multiparts must have kept their boundary and
+// all their original children, since their structure is copied from the
+// source. Parts added since have no range and are written out in full
+static gboolean can_splice(MimeModel* m, GMimeObject* obj, gint64* pos) {
+	struct SourceRange* r = g_hash_table_lookup(m->ranges, obj);
+	if(!r || r->start < *pos)
+		return FALSE;
+	if(GMIME_IS_MULTIPART(obj)) {
+		GMimeMultipart* mp = GMIME_MULTIPART(obj);
+		if(r->modified & RANGE_REPLACED)
+			return FALSE;
+		*pos = r->body;
+		int n = g_mime_multipart_get_count(mp), originals = 0;
+		gboolean trailing = FALSE; // whether new parts follow the last original
+		for(int i = 0; i < n; ++i) {
+			GMimeObject* child = g_mime_multipart_get_part(mp, i);
+			if(!g_hash_table_contains(m->ranges, child)) {
+				trailing = TRUE;
+				continue;
+			}
+			if(!can_splice(m, child, pos))
+				return FALSE;
+			originals++;
+			trailing = FALSE;
+		}
+		// new parts are placed relative to the original ones
+		if(originals != r->n_children || (originals == 0 && n > 0))
+			return FALSE;
+		if(trailing && closing_boundary(m, mp) < *pos)
+			return FALSE;
+	} else {
+		// the source range of a message part only covers its headers, so
+		// a changed one can't be written in place of it
+		if(!GMIME_IS_PART(obj) && (r->modified & (RANGE_CONTENT_MODIFIED | RANGE_REPLACED)))
+			return FALSE;
+		*pos = r->end;
+	}
+	return TRUE;
+}
+
+// adds a transfer encoding step, if the encoding needs one
+static void add_codec(GMimeStream* filtered, GMimeContentEncoding encoding, gboolean encode) {
+	if(encoding != GMIME_CONTENT_ENCODING_BASE64 && encoding != GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE && encoding != GMIME_CONTENT_ENCODING_UUENCODE)
+		return;
+	GMimeFilter* filter = wemed_filter_basic_new(encoding, encode);
+	g_mime_stream_filter_add(GMIME_STREAM_FILTER(filtered), filter);
+	g_object_unref(filter);
+}
+
+// Writes a leaf part as GMime would, but transcoding its content (e.g. a
+// file imported by reference, which is stored unencoded) with the
+// accelerated filters
+static gboolean write_leaf(GMimePart* part, GMimeStream* out) {
+	char* headers = g_mime_object_get_headers(GMIME_OBJECT(part), g_mime_format_options_get_default());
+	gboolean ok = g_mime_stream_write_string(out, headers) != -1 && g_mime_stream_write_string(out, "\n") != -1;
+	g_free(headers);
+	GMimeDataWrapper* wrapper = g_mime_part_get_content(part);
+	if(!ok || !wrapper)
+		return ok;
+
+	GMimeStream* parent;
+	GMimeStream* view = content_view(part, &parent);
+	if(!view)
+		return FALSE;
+	GMimeStream* filtered = g_mime_stream_filter_new(view);
+	GMimeContentEncoding stored = g_mime_data_wrapper_get_encoding(wrapper);
+	GMimeContentEncoding declared = g_mime_part_get_content_encoding(part);
+	if(stored != declared) {
+		add_codec(filtered, stored, FALSE);
+		add_codec(filtered, declared, TRUE);
+	}
+	ok = g_mime_stream_write_to_stream(filtered, out) != -1;
+	g_object_unref(filtered);
+	g_object_unref(view);
+	if(parent)
+		g_object_unref(parent);
+	return ok;
+}
+
+// Writes an object that has no copy in the source, laid out as GMime
+// would, with the content of its leaves written by write_leaf
+static gboolean write_fresh(GMimeObject* obj, GMimeStream* out, GCancellable* cancellable) {
+	if(g_cancellable_is_cancelled(cancellable))
+		return FALSE;
+	if(GMIME_IS_PART(obj))
+		return write_leaf(GMIME_PART(obj), out);
+	if(!GMIME_IS_MULTIPART(obj))
+		return g_mime_object_write_to_stream(obj, g_mime_format_options_get_default(), out) != -1;
+
+	GMimeMultipart* mp = GMIME_MULTIPART(obj);
+	// sets one in the headers if there is none yet
+	const char* boundary = g_mime_multipart_get_boundary(mp);
+	char* headers = g_mime_object_get_headers(obj, g_mime_format_options_get_default());
+	gboolean ok = g_mime_stream_write_string(out, headers) != -1 && g_mime_stream_write_string(out, "\n") != -1;
+	g_free(headers);
+	const char* prologue = g_mime_multipart_get_prologue(mp);
+	if(ok && prologue)
+		ok = g_mime_stream_printf(out, "%s\n", prologue) != -1;
+	for(int i = 0, n = g_mime_multipart_get_count(mp); ok && i < n; ++i) {
+		ok = g_mime_stream_printf(out, "--%s\n", boundary) != -1
+			&& write_fresh(g_mime_multipart_get_part(mp, i), out, cancellable)
+			&& g_mime_stream_write_string(out, "\n") != -1;
+	}
+	if(ok)
+		ok = g_mime_stream_printf(out, "--%s--\n", boundary) != -1;
+	const char* epilogue = g_mime_multipart_get_epilogue(mp);
+	if(ok && epilogue)
+		ok = g_mime_stream_write_string(out, epilogue) != -1;
+	return ok;
+}
+
+struct Splice {
+	GMimeStream* source;
+	GMimeStream* out;
+	GCancellable* cancellable;
+	gint64 pos; // how far through the source has been written
+	gboolean ok;
+};
+
+// copies the source verbatim up to end
+static void splice_copy(struct Splice* sp, gint64 end) {
+	if(g_cancellable_is_cancelled(sp->cancellable))
+		sp->ok = FALSE;
+	if(sp->ok && end > sp->pos) {
+		GMimeStream* piece = g_mime_stream_substream(sp->source, sp->pos, end);
+		if(g_mime_stream_write_to_stream(piece, sp->out) == -1)
+			sp->ok = FALSE;
+		g_object_unref(piece);
+	}
+	sp->pos = end;
+}
+
+static void splice_object(MimeModel* m, struct Splice* sp, GMimeObject* obj) {
+	struct SourceRange* r = g_hash_table_lookup(m->ranges, obj);
+	// everything before the part, e.g. the boundary line
+	splice_copy(sp, r->start);
+	if(!sp->ok)
+		return;
+
+	if(!GMIME_IS_MULTIPART(obj) && (r->modified & (RANGE_CONTENT_MODIFIED | RANGE_REPLACED))) {
+		if(GMIME_IS_PART(obj))
+			sp->ok = write_leaf(GMIME_PART(obj), sp->out);
+		else if(g_mime_object_write_to_stream(obj, g_mime_format_options_get_default(), sp->out) == -1)
+			sp->ok = FALSE;
+		sp->pos = r->end;
+		return;
+	}
+
+	if(r->modified & RANGE_HEADERS_MODIFIED) {
+		char* headers = g_mime_object_get_headers(obj, g_mime_format_options_get_default());
+		if(g_mime_stream_write_string(sp->out, headers) == -1 || g_mime_stream_write_string(sp->out, "\n") == -1)
+			sp->ok = FALSE;
+		g_free(headers);
+		sp->pos = r->body;
+	}
+
+	if(GMIME_IS_MULTIPART(obj)) {
+		GMimeMultipart* mp = GMIME_MULTIPART(obj);
+		const char* boundary = g_mime_multipart_get_boundary(mp);
+		for(int i = 0, n = g_mime_multipart_get_count(mp); sp->ok && i < n; ++i) {
+			GMimeObject* child = g_mime_multipart_get_part(mp, i);
+			if(g_hash_table_contains(m->ranges, child)) {
+				splice_object(m, sp, child);
+				continue;
+			}
+			// a part added since the document was read goes just before
+			// the next original part, after its boundary line, or else
+			// just before the closing boundary
+			struct SourceRange* next = NULL;
+			for(int j = i + 1; j < n && !next; ++j)
+				next = g_hash_table_lookup(m->ranges, g_mime_multipart_get_part(mp, j));
+			if(next) {
+				splice_copy(sp, next->start);
+				sp->ok = sp->ok && write_fresh(child, sp->out, sp->cancellable)
+					&& g_mime_stream_printf(sp->out, "\n--%s\n", boundary) != -1;
+			} else {
+				splice_copy(sp, closing_boundary(m, mp));
+				sp->ok = sp->ok && g_mime_stream_printf(sp->out, "--%s\n", boundary) != -1
+					&& write_fresh(child, sp->out, sp->cancellable)
+					&& g_mime_stream_write_string(sp->out, "\n") != -1;
+			}
+		}
+	} else {
+		splice_copy(sp, r->end);
+	}
+}
+
+// Writes the document by copying the bytes of every part the user hasn't
+// touched straight from the source, so that saving after a small edit is
+// fast and leaves the rest of the file exactly as it was
+static gboolean write_spliced(MimeModel* m, GMimeStream* out, GCancellable* cancellable) {
+	struct Splice sp = { m->source, out, cancellable, 0, TRUE };
+	splice_object(m, &sp, m->message);
+	// closing boundaries, epilogue
+	gint64 len = g_mime_stream_length(m->source);
+	if(len < 0)
+		return FALSE;
+	splice_copy(&sp, len);
+	return sp.ok;
+}
+
+gboolean mime_model_write_to_file(MimeModel* m, FILE* fp, GCancellable* cancellable) {
 	GMimeStream* gfs = g_mime_stream_file_new(fp);
 	if(!gfs)
 		return FALSE;
+	g_mime_stream_file_set_owner(GMIME_STREAM_FILE(gfs), FALSE);
 
-	g_mime_object_write_to_stream(GMIME_OBJECT(m->message), g_mime_format_options_get_default(), gfs);
+	gint64 pos = 0;
+	gboolean ok;
+	if(m->source && can_splice(m, m->message, &pos))
+		ok = write_spliced(m, gfs, cancellable);
+	else
+		ok = write_fresh(m->message, gfs, cancellable);
+	if(g_mime_stream_flush(gfs) != 0 || g_cancellable_is_cancelled(cancellable))
+		ok = FALSE;
 	g_object_unref(gfs);
 
-	return TRUE;
+	return ok;
+}
+
+gint64 mime_model_size_estimate(MimeModel* m) {
+	return m->source ? g_mime_stream_length(m->source) : 0;
 }
 
 void mime_model_part_remove(MimeModel* m, GMimeObject* part) {
 	GtkTreeIter iter = iter_from_obj(m, part);
 	GtkTreeIter parent = parent_node(m, iter);
 	GMimeMultipart* multipart = GMIME_MULTIPART(obj_from_iter(m, parent));
+	forget_rows(m, &iter);
 	gtk_tree_store_remove(m->store, &iter);
 	g_mime_multipart_remove(multipart, part);
 }
 
 void mime_model_free(MimeModel* m) {
 	if(m) {
+		g_debug("content cache: %u hits, %u misses", m->cache.hits, m->cache.misses);
+		while(!g_queue_is_empty(&m->cache.lru))
+			cache_entry_free(m, g_queue_peek_head(&m->cache.lru));
+		g_hash_table_destroy(m->cache.entries);
+		g_hash_table_destroy(m->generations);
+		g_hash_table_destroy(m->ranges);
+		g_hash_table_destroy(m->by_content_id);
+		g_hash_table_destroy(m->content_ids);
+		g_hash_table_destroy(m->rows);
 		g_object_unref(m->store);
 		g_object_unref(m->message);
+		if(m->source)
+			g_object_unref(m->source);
 		g_object_unref(m->filter);
 		g_object_unref(m);
 	}
 }
 
-GByteArray* mime_model_object_from_cid(GObject* emitter, const char* cid, gpointer user_data) {
-	MimeModel* m = user_data;
-	GMimeObject* part = g_mime_multipart_get_subpart_from_content_id(GMIME_MULTIPART(m->message), cid);
-	// TODO: directly from bytearray
-	GString str = mime_model_part_content(part);
-	return g_byte_array_new_take((guint8*)str.str, str.len);
-}
-
-static gsize stream_test_len(GMimeStream* stream) {
-	GMimeStream* null_stream = g_mime_stream_null_new();
-	gsize len = g_mime_stream_write_to_stream(stream, null_stream);
-	g_mime_stream_reset(stream);
-	g_object_unref(null_stream);
-	return len;
-}
-
-static gsize write_stream_to_mem(GMimeStream* stream, gchar* ptr, gint len) {
-	GByteArray* arr = g_byte_array_new_take((guint8*)ptr, len);
-	GMimeStream* mem_stream = g_mime_stream_mem_new_with_byte_array(arr);
-	g_mime_stream_mem_set_owner(GMIME_STREAM_MEM(mem_stream), FALSE);
-	g_mime_stream_reset(stream);
-	g_mime_stream_write_to_stream(stream, mem_stream);
-	g_mime_stream_reset(stream);
-	GBytes* bytes = g_byte_array_free_to_bytes(arr);
-	gsize sz;
-	g_bytes_unref_to_data(bytes, &sz);
-	ptr[sz] = '\0'; // can finally terminate here
-	g_object_unref(mem_stream);
-	return sz;
+GMimeObject* mime_model_find_cid(MimeModel* m, const char* cid) {
+	struct ContentIdEntry* e = g_hash_table_lookup(m->by_content_id, cid);
+	return e ? e->part : NULL;
 }
 
 GString mime_model_part_headers(GMimeObject* obj) {
@@ -459,35 +1230,249 @@ GString mime_model_part_headers(GMimeObject* obj) {
 	return ret;
 }
 
-GString mime_model_part_content(GMimeObject* obj) {
-	GString ret = {0, 0, 0};
-	if(!GMIME_IS_PART(obj))
-		return ret;
-
-	GMimePart* part = GMIME_PART(obj);
-
-	GMimeDataWrapper* data_obj = g_mime_part_get_content(part);
-	if(data_obj == NULL) // empty part
-		return ret;
-
-	GMimeStream* source = g_mime_data_wrapper_get_stream(data_obj);
-	g_mime_stream_reset(source);
-	GMimeContentEncoding encoding = g_mime_part_get_content_encoding(part);
+// Decodes a stream in a single pass straight into the buffer which will back
+// the returned GBytes. Returns NULL if the operation was cancelled
+static GBytes* decode_stream(GMimeStream* source, GMimeContentEncoding encoding, GCancellable* cancellable) {
+	// the decoded data is never larger than the encoded data for any of
+	// the transfer encodings, so this usually avoids reallocating at all
+	gint64 encoded_length = g_mime_stream_length(source);
+	GByteArray* arr = g_byte_array_sized_new(encoded_length > 0 ? (guint) encoded_length + 1 : 4096);
 
-	GMimeFilter* decoding_filter = g_mime_filter_basic_new(encoding, FALSE);
-	GMimeFilter* encoding_filter = g_mime_filter_basic_new(GMIME_CONTENT_ENCODING_BINARY, TRUE);
+	GMimeFilter* decoding_filter = wemed_filter_basic_new(encoding, FALSE);
 	GMimeStream* stream_filter = g_mime_stream_filter_new(source);
 	g_mime_stream_filter_add(GMIME_STREAM_FILTER(stream_filter), decoding_filter);
-	g_mime_stream_filter_add(GMIME_STREAM_FILTER(stream_filter), encoding_filter);
-	// get the length of the decoded data
-	gsize decoded_length = stream_test_len(stream_filter);
-	ret.str = (char*) malloc((size_t) decoded_length + 1); // null termination
-	ret.allocated_len = decoded_length+1;
-	ret.len = decoded_length;
-	write_stream_to_mem(stream_filter, ret.str, decoded_length);
+	while(!g_mime_stream_eos(stream_filter)) {
+		if(g_cancellable_is_cancelled(cancellable))
+			break;
+		guint len = arr->len;
+		g_byte_array_set_size(arr, len + 65536);
+		gssize n = g_mime_stream_read(stream_filter, (char*) &arr->data[len], 65536);
+		g_byte_array_set_size(arr, len + MAX(n, 0));
+		if(n < 0)
+			break;
+	}
 	g_object_unref(decoding_filter);
-	g_object_unref(encoding_filter);
 	g_object_unref(stream_filter);
 
+	if(g_cancellable_is_cancelled(cancellable)) {
+		g_byte_array_unref(arr);
+		return NULL;
+	}
+
+	// terminate the buffer without counting the terminator in the size
+	g_byte_array_append(arr, (const guint8*) "", 1);
+	g_byte_array_set_size(arr, arr->len - 1);
+	return g_byte_array_free_to_bytes(arr);
+}
+
+// A GInputStream of the decoded content of a part, for consumers outside
+// GMime. The content is decoded as it is read, which for asynchronous
+// reads happens on a GIO worker thread
+typedef struct {
+	GInputStream parent;
+	GMimeStream* decoded;
+	GMimeStream* view;
+	// keeps the backing store of the view alive
+	GMimeStream* backing;
+} PartInputStream;
+
+typedef struct {
+	GInputStreamClass parent_class;
+} PartInputStreamClass;
+
+G_DEFINE_TYPE(PartInputStream, part_input_stream, G_TYPE_INPUT_STREAM)
+
+static void part_input_stream_release(PartInputStream* s) {
+	g_clear_object(&s->decoded);
+	g_clear_object(&s->view);
+	g_clear_object(&s->backing);
+}
+
+static gssize part_input_stream_read(GInputStream* stream, void* buffer, gsize count, GCancellable* cancellable, GError** error) {
+	PartInputStream* s = (PartInputStream*) stream;
+	if(g_cancellable_set_error_if_cancelled(cancellable, error))
+		return -1;
+	ssize_t n = g_mime_stream_read(s->decoded, buffer, MIN(count, G_MAXSSIZE));
+	if(n < 0) {
+		g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not read the content of the part");
+		return -1;
+	}
+	return n;
+}
+
+static gboolean part_input_stream_close(GInputStream* stream, GCancellable* cancellable, GError** error) {
+	part_input_stream_release((PartInputStream*) stream);
+	return TRUE;
+}
+
+static void part_input_stream_finalize(GObject* object) {
+	part_input_stream_release((PartInputStream*) object);
+	G_OBJECT_CLASS(part_input_stream_parent_class)->finalize(object);
+}
+
+static void part_input_stream_class_init(PartInputStreamClass* class) {
+	G_OBJECT_CLASS(class)->finalize = part_input_stream_finalize;
+	G_INPUT_STREAM_CLASS(class)->read_fn = part_input_stream_read;
+	G_INPUT_STREAM_CLASS(class)->close_fn = part_input_stream_close;
+}
+
+static void part_input_stream_init(PartInputStream* s) {
+}
+
+GInputStream* mime_model_part_stream(MimeModel* m, GMimeObject* obj, gint64* length) {
+	*length = -1;
+	GMimeDataWrapper* data_obj = GMIME_IS_PART(obj) ? g_mime_part_get_content(GMIME_PART(obj)) : NULL;
+	if(data_obj == NULL)
+		return NULL;
+
+	GBytes* cached = cache_lookup(m, obj);
+	if(cached) {
+		*length = g_bytes_get_size(cached);
+		GInputStream* stream = g_memory_input_stream_new_from_bytes(cached);
+		g_bytes_unref(cached);
+		return stream;
+	}
+
+	GMimeStream* backing;
+	GMimeStream* view = content_view(GMIME_PART(obj), &backing);
+	if(view == NULL)
+		return NULL;
+	GMimeContentEncoding encoding = g_mime_data_wrapper_get_encoding(data_obj);
+	switch(encoding) {
+	case GMIME_CONTENT_ENCODING_DEFAULT:
+	case GMIME_CONTENT_ENCODING_7BIT:
+	case GMIME_CONTENT_ENCODING_8BIT:
+	case GMIME_CONTENT_ENCODING_BINARY:
+		// decoding doesn't change the size
+		*length = g_mime_stream_length(view);
+		break;
+	default:
+		break;
+	}
+	PartInputStream* s = g_object_new(part_input_stream_get_type(), NULL);
+	s->view = view;
+	s->backing = backing;
+	s->decoded = decoding_stream(view, encoding);
+	return G_INPUT_STREAM(s);
+}
+
+struct ContentJob {
+	// keeps the backing store of the stream alive
+	GMimeStream* parent;
+	// a view of the content with its own position, so it can be read
+	// without disturbing the main thread
+	GMimeStream* stream;
+	GMimeContentEncoding encoding;
+	char* charset;
+	// if the decoded content was cached, only the conversion remains
+	GBytes* cached;
+	// the part and its generation at the time of the request, so the
+	// result can be added to the cache on completion
+	GMimeObject* part;
+	guint generation;
+};
+
+struct ContentResult {
+	GBytes* decoded;
+	GBytes* converted;
+};
+
+static void content_job_free(struct ContentJob* job) {
+	if(job->stream)
+		g_object_unref(job->stream);
+	if(job->parent)
+		g_object_unref(job->parent);
+	if(job->cached)
+		g_bytes_unref(job->cached);
+	g_object_unref(job->part);
+	g_free(job->charset);
+	g_free(job);
+}
+
+static void content_result_free(struct ContentResult* r) {
+	if(r->decoded)
+		g_bytes_unref(r->decoded);
+	if(r->converted)
+		g_bytes_unref(r->converted);
+	g_free(r);
+}
+
+static void decode_content_thread(GTask* task, gpointer source_object, gpointer task_data, GCancellable* cancellable) {
+	struct ContentJob* job = task_data;
+	struct ContentResult* r = g_new0(struct ContentResult, 1);
+	r->decoded = job->cached ? g_bytes_ref(job->cached) : decode_stream(job->stream, job->encoding, cancellable);
+	if(r->decoded && job->charset) {
+		gsize len, sz;
+		const char* str = g_bytes_get_data(r->decoded, &len);
+		char* converted = g_convert(str ?: "", len, "utf-8", job->charset, NULL, &sz, NULL);
+		if(converted)
+			r->converted = g_bytes_new_take(converted, sz);
+		else
+			fprintf(stderr, "Conversion from %s to utf8 failed\n", job->charset);
+	}
+	if(g_task_return_error_if_cancelled(task)) {
+		content_result_free(r);
+		return;
+	}
+	g_task_return_pointer(task, r, (GDestroyNotify) content_result_free);
+}
+
+void mime_model_part_content_async(MimeModel* m, GMimeObject* obj, const char* to_utf8_from, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+	GTask* task = g_task_new(m, cancellable, callback, user_data);
+	GMimeDataWrapper* data_obj = GMIME_IS_PART(obj) ? g_mime_part_get_content(GMIME_PART(obj)) : NULL;
+	if(data_obj == NULL) {
+		g_task_return_pointer(task, g_new0(struct ContentResult, 1), (GDestroyNotify) content_result_free);
+		g_object_unref(task);
+		return;
+	}
+
+	struct ContentJob* job = g_new0(struct ContentJob, 1);
+	job->part = g_object_ref(obj);
+	job->generation = GPOINTER_TO_UINT(g_hash_table_lookup(m->generations, obj));
+	job->charset = g_strdup(to_utf8_from);
+	job->cached = cache_lookup(m, obj);
+	g_task_set_task_data(task, job, (GDestroyNotify) content_job_free);
+
+	if(job->cached && !job->charset) {
+		// nothing left to do off the main thread
+		struct ContentResult* r = g_new0(struct ContentResult, 1);
+		r->decoded = g_bytes_ref(job->cached);
+		g_task_return_pointer(task, r, (GDestroyNotify) content_result_free);
+	} else {
+		if(!job->cached) {
+			job->stream = content_view(GMIME_PART(obj), &job->parent);
+			job->encoding = g_mime_data_wrapper_get_encoding(data_obj);
+			if(job->stream == NULL) {
+				g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Content is not readable");
+				g_object_unref(task);
+				return;
+			}
+		}
+		g_task_run_in_thread(task, decode_content_thread);
+	}
+	g_object_unref(task);
+}
+
+GBytes* mime_model_part_content_finish(MimeModel* m, GAsyncResult* result, GError** error) {
+	struct ContentResult* r = g_task_propagate_pointer(G_TASK(result), error);
+	if(!r)
+		return NULL;
+
+	struct ContentJob* job = g_task_get_task_data(G_TASK(result));
+	// don't cache content which was decoded before the part changed
+	if(job && !job->cached && r->decoded && job->generation == GPOINTER_TO_UINT(g_hash_table_lookup(m->generations, job->part)) && g_hash_table_contains(m->rows, job->part))
+		cache_insert(m, job->part, job->generation, r->decoded);
+
+	GBytes* ret = NULL;
+	if(r->converted)
+		ret = g_bytes_ref(r->converted);
+	else if(r->decoded && !(job && job->charset)) // failed conversions yield nothing
+		ret = g_bytes_ref(r->decoded);
+	content_result_free(r);
 	return ret;
 }
+
+void mime_model_content_cache_stats(MimeModel* m, guint* hits, guint* misses) {
+	*hits = m->cache.hits;
+	*misses = m->cache.misses;
+}
@@ -20,7 +20,10 @@ enum {
 	MIME_MODEL_NUM_COLS
 };
 
-MimeModel* mime_model_new(GString from_content);
+// Parses a document from source, which must be seekable and must not
+// change while the model exists. A NULL source creates an empty document.
+// Returns NULL if the document can't be parsed
+MimeModel* mime_model_new(GMimeStream* source);
 void mime_model_create_blank_email(MimeModel* m);
 
 GtkTreeModel* mime_model_get_gtk_model(MimeModel*);
@@ -30,7 +33,18 @@ char *mime_model_content_type(GMimeObject* obj);
 
 GMimeObject* mime_model_root(MimeModel*);
 
-GString mime_model_part_content(GMimeObject* part);
+// Whether obj is (still) a part of this model
+gboolean mime_model_contains(MimeModel* m, GMimeObject* obj);
+
+// Decodes the content of a part on a worker thread, optionally converting
+// it to utf-8 from the given charset. The part's content may be replaced
+// while this is running, but the result will then reflect the old content.
+// Recently decoded parts are served from a cache owned by the model
+void mime_model_part_content_async(MimeModel* m, GMimeObject* part, const char* to_utf8_from, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data);
+GBytes* mime_model_part_content_finish(MimeModel* m, GAsyncResult* result, GError** error);
+
+// for diagnostics: the number of decoded content cache hits and misses
+void mime_model_content_cache_stats(MimeModel* m, guint* hits, guint* misses);
 GString mime_model_part_headers(GMimeObject* part);
 
 GMimeObject* mime_model_update_header(MimeModel*, GMimeObject* obj, GString new_header);
@@ -39,19 +53,45 @@ GMimeObject* mime_model_find_mixed_parent(MimeModel* m, GMimeObject* part);
 
 void mime_model_update_content(MimeModel*, GMimePart* obj, GString new_content);
 
+// Makes the file the content of part by reference. It is read when the
+// part is displayed and encoded as the document is saved, so it must
+// stay in place until then
+gboolean mime_model_set_part_file(MimeModel* m, GMimePart* part, const char* filename);
+
 GMimeObject* mime_model_new_node(MimeModel* m, GMimeObject* parent_or_sibling, const char* content_type);
 
-// writes a part to a file, decoding base64 etc
-void mime_model_write_part(GMimePart* part, FILE* fp);
+// writes a part to a file, decoding base64 etc. fp is flushed but not
+// closed
+gboolean mime_model_write_part(GMimePart* part, FILE* fp);
+
+// Writes the decoded content of a leaf part (or the message in a
+// message/rfc822 part) to fd. May be called from several worker threads
+// at once provided the parts aren't modified meanwhile, although messages
+// are written one at a time. Content stored without a transfer encoding
+// is copied by the kernel where possible
+gboolean mime_model_export_part(GMimeObject* part, int fd, GCancellable* cancellable);
 
 void mime_model_set_part_content(GMimePart* part, FILE* fp);
 
 void mime_model_part_remove(MimeModel* m, GMimeObject* part);
 
-// write the whole message to a file in MIME format
-gboolean mime_model_write_to_file(MimeModel* m, FILE* fp);
+// write the whole message to a file in MIME format. fp is flushed but not
+// closed. May be called from a worker thread provided the model isn't
+// modified meanwhile; cancelling abandons the write part way through
+gboolean mime_model_write_to_file(MimeModel* m, FILE* fp, GCancellable* cancellable);
+
+// roughly how many bytes mime_model_write_to_file will write, or 0
+gint64 mime_model_size_estimate(MimeModel* m);
+
+// The part with the given Content-ID, or NULL
+GMimeObject* mime_model_find_cid(MimeModel* m, const char* cid);
 
-GByteArray* mime_model_object_from_cid(GObject* emitter, const char* cid, gpointer user_data);
+// Opens a stream of the decoded content of a part. It is served from the
+// content cache if possible, and otherwise decoded as it is read, which
+// may be done on another thread. *length receives the decoded size, or
+// -1 if that isn't known without decoding. Returns NULL for multiparts
+// and parts without content
+GInputStream* mime_model_part_stream(MimeModel* m, GMimeObject* part, gint64* length);
 
 void mime_model_free(MimeModel*);
 
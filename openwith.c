@@ -6,74 +6,66 @@
 #include <stdio.h>
 #include <string.h>
 #include "openwith.h"
-#include "exec.h"
-
-static void populate_options(const char* content_type, GtkIconTheme* icontheme, GtkListStore* store) {
-	// first get all the possible apps from the MIME cache
-	char buffer[20001] = {0};
-	ssize_t n;
-
-	char* grepsearch = malloc(1 + strlen(content_type) + 2);
-	sprintf(grepsearch, "^%s=", content_type);
-	const char* args[] = { "grep", grepsearch, "/usr/share/applications/mimeinfo.cache", 0 };
-
-	n = exec_get(buffer, 20000, "grep", args);
-	if(n < 0)
-		return free(grepsearch);
-
-	*strchrnul(buffer, '\n') = '\0';
-	free(grepsearch);
-
-	char* apps = strchr(buffer, '=') + 1;
-
-	// now we have their .desktops in our buffer, get all the possible apps.
-	// to save execution overhead, do it in one big grep
-	const char* argv[100];
-	argv[0] = "grep";
-	argv[1] = "-E";
-	argv[2] = "-H";
-	argv[3] = "-Z";
-	argv[4] = "^Name=|^Exec=|^Icon=";
-	argv[5] = apps;
-	int argc = 5;
-	for(char* p = apps; *p; ++p) {
-		if(*p == ';') {
-			*p++ = 0;
-			argv[++argc] = p;
-		}
+#include "mimeapp.h"
+
+struct IconLoad {
+	GtkListStore* store;
+	GtkTreeIter iter; // GtkListStore iters persist
+};
+
+static void icon_loaded(GObject* source, GAsyncResult* result, gpointer user_data) {
+	struct IconLoad* load = user_data;
+	GdkPixbuf* icon = gtk_icon_info_load_icon_finish(GTK_ICON_INFO(source), result, NULL);
+	if(icon) {
+		gtk_list_store_set(load->store, &load->iter, 0, icon, -1);
+		g_object_unref(icon);
 	}
-	argv[argc] = 0;
-
-	if(chdir("/usr/share/applications")) return;
-	n = exec_get(buffer, 20000, "grep", argv);
-	if(n < 0) return;
-	
-	// now we have all the apps, get their names, paths and icons
-	char *pf = buffer, *pe = 0, *pn = 0, *pi = 0;
-	for(char* p = buffer; p != &buffer[n]; ++p) {
-		if(*p == '\0') {
-			if(pn == 0 && strncmp(&p[1], "Name=", 5) == 0) {
-				pn = &p[6];
-			} else if(pe == 0 && strncmp(&p[1], "Exec=", 5) == 0) {
-				pe = &p[6];
-			} else if(pi == 0 && strncmp(&p[1], "Icon=", 5) == 0) {
-				pi = &p[6];
-			}
-		}
-		else if(*p == '\n') {
-			*p = '\0';
-			if(strcmp(&p[1], pf) != 0) {
-				GdkPixbuf* icon = gtk_icon_theme_load_icon(icontheme, pi, 16, GTK_ICON_LOOKUP_USE_BUILTIN, 0);
-				GtkTreeIter iter;
-				gtk_list_store_append(store, &iter);
-				gtk_list_store_set(store, &iter, 0, icon, 1, pn, 2, pe, -1);
-				pn = pe = pi = 0;
-				pf = &p[1];
-			}
+	g_object_unref(load->store);
+	g_free(load);
+}
+
+struct PopulateJob {
+	GtkIconTheme* icontheme;
+	GtkListStore* store;
+	GCancellable* cancellable;
+};
+
+static void add_options(const struct MimeAppEntry* const* apps, guint n_apps, gpointer user_data) {
+	struct PopulateJob* job = user_data;
+	for(guint i = 0; i < n_apps; ++i) {
+		GtkTreeIter iter;
+		gtk_list_store_append(job->store, &iter);
+		gtk_list_store_set(job->store, &iter, 1, apps[i]->name, 2, apps[i]->exec, -1);
+		// the list is usable straight away, icons follow as they load
+		GtkIconInfo* info = apps[i]->icon ? gtk_icon_theme_lookup_by_gicon(job->icontheme, apps[i]->icon, 16, GTK_ICON_LOOKUP_USE_BUILTIN) : NULL;
+		if(info) {
+			struct IconLoad* load = g_new0(struct IconLoad, 1);
+			load->store = g_object_ref(job->store);
+			load->iter = iter;
+			gtk_icon_info_load_icon_async(info, job->cancellable, icon_loaded, load);
+			g_object_unref(info);
 		}
 	}
 }
 
+static void populate_job_free(struct PopulateJob* job) {
+	g_object_unref(job->store);
+	g_object_unref(job->cancellable);
+	g_free(job);
+}
+
+// fills the store with the applications registered for the content type
+// from the desktop entry index. Icons load in the background until the
+// cancellable is triggered
+static struct PopulateJob* populate_options(const char* content_type, GtkIconTheme* icontheme, GtkListStore* store, GCancellable* cancellable) {
+	struct PopulateJob* job = g_new0(struct PopulateJob, 1);
+	job->icontheme = icontheme;
+	job->store = g_object_ref(store);
+	job->cancellable = g_object_ref(cancellable);
+	mime_app_index_lookup(content_type, cancellable, add_options, job);
+	return job;
+}
+
 static GtkWidget* create_list_widget() {
 	GtkWidget* view = gtk_tree_view_new();
 	GtkTreeSelection *select = gtk_tree_view_get_selection (GTK_TREE_VIEW(view));
@@ -99,7 +91,8 @@ char* open_with(GtkWidget* parent, const char* content_type) {
 	GtkIconTheme* git = gtk_icon_theme_get_default();
 
 	GtkListStore* store = gtk_list_store_new(3, G_TYPE_OBJECT, G_TYPE_STRING, G_TYPE_STRING);
-	populate_options(content_type, git, store);
+	GCancellable* cancellable = g_cancellable_new();
+	struct PopulateJob* job = populate_options(content_type, git, store, cancellable);
 
 	GtkTreeModel* model = GTK_TREE_MODEL(store);
 	GtkWidget* view = create_list_widget();
@@ -128,13 +121,19 @@ char* open_with(GtkWidget* parent, const char* content_type) {
 		} else {
 			GtkTreeIter iter;
 			char* exec_entry;
-			gtk_tree_selection_get_selected(gtk_tree_view_get_selection(GTK_TREE_VIEW(view)), &model, &iter);
-			gtk_tree_model_get(model, &iter, 2, &exec_entry, -1);
-			ret = strdup(exec_entry);
+			// the list is filled asynchronously, so it may still be empty
+			if(gtk_tree_selection_get_selected(gtk_tree_view_get_selection(GTK_TREE_VIEW(view)), &model, &iter)) {
+				gtk_tree_model_get(model, &iter, 2, &exec_entry, -1);
+				ret = strdup(exec_entry);
+			}
 		}
 	}
 
 	gtk_widget_destroy(dialog);
+	g_cancellable_cancel(cancellable);
+	populate_job_free(job);
+	g_object_unref(cancellable);
+	g_object_unref(store);
 
 	return ret;
 }
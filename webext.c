@@ -13,13 +13,23 @@ typedef struct {
 	gboolean load_remote;
 } WemedExt;
 
-static void input_cb(WebKitWebPage* web_page) {
-	webkit_web_page_send_message_to_view(web_page, webkit_user_message_new("dirtied", NULL), NULL, NULL, NULL);
+// per-page edit tracking, so that typing doesn't send a message to the
+// UI process on every keystroke
+typedef struct {
+	WebKitWebPage* web_page;
+	gboolean dirty; // reset by a "set-clean" message
+} PageState;
+
+static void input_cb(PageState* st) {
+	if(!st->dirty) {
+		st->dirty = TRUE;
+		webkit_web_page_send_message_to_view(st->web_page, webkit_user_message_new("dirtied", NULL), NULL, NULL, NULL);
+	}
 }
 
-static void loaded_cb(WebKitWebPage* web_page, WemedExt* ext) {
+static void loaded_cb(WebKitWebPage* web_page, PageState* st) {
 	JSCContext* ctx = webkit_frame_get_js_context(webkit_web_page_get_main_frame(web_page));
-	jsc_context_set_value(ctx, "__notifyChanged", jsc_value_new_function(ctx, NULL, G_CALLBACK(input_cb), web_page, NULL, G_TYPE_NONE, 0));
+	jsc_context_set_value(ctx, "__notifyChanged", jsc_value_new_function(ctx, NULL, G_CALLBACK(input_cb), st, NULL, G_TYPE_NONE, 0));
 	static const char *code = "document.documentElement.addEventListener('input', __notifyChanged);";
 	JSCValue *value = jsc_context_evaluate(ctx, code, strlen(code));
 	g_object_unref(value);
@@ -35,16 +45,25 @@ static gboolean send_request_cb(WebKitWebPage* web_page, WebKitURIRequest* reque
 }
 
 static gboolean user_message_received_cb(WebKitWebPage* web_page, WebKitUserMessage *message, gpointer user_data) {
-	if(g_strcmp0(webkit_user_message_get_name(message), "load-remote-resources") == 0) {
+	const char* name = webkit_user_message_get_name(message);
+	if(g_strcmp0(name, "load-remote-resources") == 0) {
 		WemedExt* ext = (WemedExt*) user_data;
 		ext->load_remote = g_variant_get_boolean(webkit_user_message_get_parameters(message));
 		return TRUE;
 	}
+	PageState* st = (PageState*) g_object_get_data(G_OBJECT(web_page), "wemed-page-state");
+	if(g_strcmp0(name, "set-clean") == 0) {
+		st->dirty = FALSE;
+		return TRUE;
+	}
 	return FALSE;
 }
 
 static void web_page_created_callback(WebKitWebExtension* extension, WebKitWebPage* web_page, WemedExt* ext) {
-	g_signal_connect(web_page, "document-loaded", G_CALLBACK(loaded_cb), ext);
+	PageState* st = g_new0(PageState, 1);
+	st->web_page = web_page;
+	g_object_set_data_full(G_OBJECT(web_page), "wemed-page-state", st, g_free);
+	g_signal_connect(web_page, "document-loaded", G_CALLBACK(loaded_cb), st);
 	g_signal_connect(web_page, "send-request", G_CALLBACK(send_request_cb), ext);
 	g_signal_connect(web_page, "user-message-received", G_CALLBACK(user_message_received_cb), ext);
 }
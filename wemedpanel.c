@@ -20,7 +20,10 @@ extern GtkIconTheme* system_icon_theme;
 // the private elements
 typedef struct {
 	GtkWidget* webview;
-	WebKitWebContext* webkit_ctx;
+	// when the first document was given to the webview, for measuring
+	// how long it takes to appear
+	gint64 first_load_start;
+	gboolean first_load_done;
 	GtkWidget* sourceview;
 	GtkTextBuffer* sourcetext;
 	gboolean webkit_dirty;
@@ -28,6 +31,7 @@ typedef struct {
 	GtkTextBuffer* headertext;
 	GtkWidget* toolbar;
 	GtkWidget* progress_bar;
+	guint pulse_source;
 	gboolean load_remote;
 	gboolean view_source;
 	GtkWidget* open_ext_box;
@@ -78,36 +82,44 @@ GString wemed_panel_get_headers(WemedPanel* wp) {
 }
 
 static void get_content_callback(GObject *source_object, GAsyncResult *res, gpointer user_data) {
-	JSCValue* val;
-	GString* out_str = (GString*) user_data;
-
-	val = webkit_web_view_evaluate_javascript_finish (WEBKIT_WEB_VIEW (source_object), res, NULL);
-	g_assert(jsc_value_is_string(val));
-	out_str->str = jsc_value_to_string(val);
-	out_str->len = strlen(out_str->str);
+	GTask* task = G_TASK(user_data);
+	GError* err = NULL;
+	JSCValue* val = webkit_web_view_evaluate_javascript_finish(WEBKIT_WEB_VIEW(source_object), res, &err);
+	if(val && jsc_value_is_string(val)) {
+		g_task_return_pointer(task, jsc_value_to_string(val), g_free);
+	} else if(err) {
+		g_task_return_error(task, err);
+	} else {
+		g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "HTML content is not a string");
+	}
+	if(val)
+		g_object_unref(val);
+	g_object_unref(task);
 }
 
-// In webkit1 you could synchronously get the html contents. Making this method
-// work asynchronously is a bigger effort than I have time for right now, so here
-// we manually iterate the gtk mainloop until our callback is dealt with
-GString wemed_panel_get_content(WemedPanel* wp) {
+// Fetching the HTML from WebKit is a round trip to the web process, so
+// rather than blocking the caller this completes from the main loop.
+// Source view content is available immediately
+void wemed_panel_get_content_async(WemedPanel* wp, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data) {
 	GET_D(wp);
-	GString result = {0};
+	GTask* task = g_task_new(wp, cancellable, callback, user_data);
 
 	if(gtk_widget_is_visible(d->sourceview)) {
 		GtkTextIter start, end;
-		gtk_text_buffer_get_start_iter(d->sourcetext, &start);
-		gtk_text_buffer_get_end_iter(d->sourcetext, &end);
-		result.str = gtk_text_buffer_get_text(d->sourcetext, &start, &end, TRUE);
-		result.len = gtk_text_iter_get_offset(&end);
+		gtk_text_buffer_get_bounds(d->sourcetext, &start, &end);
+		g_task_return_pointer(task, gtk_text_buffer_get_text(d->sourcetext, &start, &end, TRUE), g_free);
+		g_object_unref(task);
 	} else {
-		GMainContext* ctx = g_main_context_default();
-		webkit_web_view_evaluate_javascript(WEBKIT_WEB_VIEW(d->webview), "document.documentElement.outerHTML", -1, NULL, NULL, NULL, get_content_callback, &result);
-		while(result.str == NULL)
-			g_main_context_iteration(ctx, TRUE);
+		webkit_web_view_evaluate_javascript(WEBKIT_WEB_VIEW(d->webview), "document.documentElement.outerHTML", -1, NULL, NULL, cancellable, get_content_callback, task);
 	}
+}
 
-	return result;
+GString wemed_panel_get_content_finish(WemedPanel* wp, GAsyncResult* result, GError** error) {
+	GString s = {0};
+	s.str = g_task_propagate_pointer(G_TASK(result), error);
+	if(s.str)
+		s.len = strlen(s.str);
+	return s;
 }
 
 static void edit_bold_cb(GtkToolItem* item, WemedPanel* wp) {
@@ -187,24 +199,15 @@ static void edit_image_cb(GtkToolItem* item, WemedPanel* wp) {
 	g_signal_connect(dialog, "update-preview", G_CALLBACK (update_preview_cb), preview);
 
 	if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT) {
-		GSList* files = gtk_file_chooser_get_files(GTK_FILE_CHOOSER(dialog));
-		GSList* p = files;
-		while(p) {
-			GFile* f = p->data;
-			char* path = g_file_get_path(f);
-			char* cid = 0;
-			g_signal_emit(wp, wemed_panel_signals[WP_SIG_IMPORT], 0, path, &cid);
-			if(cid) {
-				char* exec = 0;
-				asprintf(&exec, "document.execCommand('insertimage', false, 'cid:%s')", cid);
-				webkit_web_view_evaluate_javascript(WEBKIT_WEB_VIEW(d->webview), exec, -1, NULL, NULL, NULL, NULL, NULL);
-				free(cid);
-				free(exec);
-			}
-			g_free(path);
-			g_object_unref(f);
-			p = p->next;
-		}
+		// the images are imported in the background and inserted with
+		// wemed_panel_insert_images once they're in the document
+		GSList* files = gtk_file_chooser_get_filenames(GTK_FILE_CHOOSER(dialog));
+		GPtrArray* paths = g_ptr_array_new_with_free_func(g_free);
+		for(GSList* p = files; p; p = p->next)
+			g_ptr_array_add(paths, p->data);
+		g_ptr_array_add(paths, NULL);
+		g_signal_emit(wp, wemed_panel_signals[WP_SIG_IMPORT], 0, paths->pdata);
+		g_ptr_array_free(paths, TRUE);
 		g_slist_free(files);
 	}
 
@@ -212,6 +215,15 @@ static void edit_image_cb(GtkToolItem* item, WemedPanel* wp) {
 	gtk_widget_destroy (dialog);
 }
 
+void wemed_panel_insert_images(WemedPanel* wp, const char* const* cids) {
+	GET_D(wp);
+	GString* js = g_string_new(NULL);
+	for(; *cids; ++cids)
+		g_string_append_printf(js, "document.execCommand('insertimage', false, 'cid:%s');", *cids);
+	webkit_web_view_evaluate_javascript(WEBKIT_WEB_VIEW(d->webview), js->str, -1, NULL, NULL, NULL, NULL, NULL);
+	g_string_free(js, TRUE);
+}
+
 static gboolean filter_variant_fonts(const PangoFontFamily* family, const PangoFontFace* face, gpointer data) {
 	gboolean include = FALSE;
 	PangoFontDescription* font = pango_font_face_describe((PangoFontFace*) face);
@@ -257,19 +269,20 @@ static void openwith_cb(GtkButton* btn, WemedPanel* wp) {
 }
 
 static void load_cid_cb(WebKitURISchemeRequest *request, gpointer user_data) {
-	WemedPanel* wp = (WemedPanel*) user_data;
+	// the scheme is registered once for the shared context
+	WemedPanel* wp = g_object_get_data(G_OBJECT(webkit_uri_scheme_request_get_web_view(request)), "wemed-panel");
 	const char* path = webkit_uri_scheme_request_get_path(request);
-	GByteArray* s = NULL;
-	// this is a synchronous signal which should populate a GByteArray
-	g_signal_emit(wp, wemed_panel_signals[WP_SIG_GET_CID], 0, path, &s);
-
-	if(s && s->data) {
-		GInputStream* stream;
-		stream = g_memory_input_stream_new_from_data(s->data, s->len, g_free);
-		// In theory we could also give the MIME type from the mimemodel, but webkit
-		// does just fine with NULL...
-		webkit_uri_scheme_request_finish (request, stream,  s->len, NULL);
-		g_object_unref(stream);
+	WemedPanelResource res = { NULL, -1, NULL };
+	gboolean found = FALSE;
+	// the handler only opens the stream; WebKit reads (and so decodes) it
+	// asynchronously, off the main thread
+	if(wp)
+		g_signal_emit(wp, wemed_panel_signals[WP_SIG_GET_CID], 0, path, &res, &found);
+
+	if(found && res.stream) {
+		webkit_uri_scheme_request_finish(request, res.stream, res.length, res.content_type);
+		g_object_unref(res.stream);
+		g_free(res.content_type);
 	} else {
 		GError *error;
 		error = g_error_new(g_quark_from_string("wemed"), 0, "Invalid cid:%s link.", path);
@@ -278,6 +291,54 @@ static void load_cid_cb(WebKitURISchemeRequest *request, gpointer user_data) {
 	}
 }
 
+// All panels share one web context, and a hidden view created at startup
+// whose web process they reuse, so that the process is already running
+// with the extension loaded when the first HTML part is shown
+static WebKitWebView* warm_view;
+// when the warm view finished loading, or 0
+static gint64 warm_since;
+static gint64 warm_start;
+
+static void warm_view_load_changed(WebKitWebView* view, WebKitLoadEvent event, gpointer user_data) {
+	if(event == WEBKIT_LOAD_FINISHED && warm_since == 0) {
+		warm_since = g_get_monotonic_time();
+		g_debug("web process ready after %.1f ms", (warm_since - warm_start) / 1000.0);
+	}
+}
+
+void wemed_panel_prewarm(void) {
+	if(warm_view)
+		return;
+	warm_start = g_get_monotonic_time();
+	WebKitWebContext* ctx = webkit_web_context_new();
+	webkit_web_context_set_cache_model(ctx, WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER);
+	g_signal_connect(ctx, "initialize-web-extensions", G_CALLBACK(initialize_web_extensions), NULL);
+	webkit_web_context_register_uri_scheme(ctx, "cid", load_cid_cb, NULL, NULL);
+	warm_view = WEBKIT_WEB_VIEW(g_object_ref_sink(webkit_web_view_new_with_context(ctx)));
+	g_object_unref(ctx); // the view keeps it
+	// the web process isn't started until something is loaded. Setting
+	// WEMED_NO_PREWARM leaves that to the first panel, so the first render
+	// can be timed from cold
+	if(g_getenv("WEMED_NO_PREWARM"))
+		return;
+	g_signal_connect(warm_view, "load-changed", G_CALLBACK(warm_view_load_changed), NULL);
+	webkit_web_view_load_uri(warm_view, "about:blank");
+}
+
+static void note_first_load(WemedPanelPrivate* d) {
+	if(d->first_load_start == 0)
+		d->first_load_start = g_get_monotonic_time();
+}
+
+static void load_changed_cb(WebKitWebView* view, WebKitLoadEvent event, WemedPanel* wp) {
+	GET_D(wp);
+	if(event != WEBKIT_LOAD_FINISHED || d->first_load_start == 0 || d->first_load_done)
+		return;
+	d->first_load_done = TRUE;
+	gboolean warm = warm_since != 0 && warm_since <= d->first_load_start;
+	g_debug("first render took %.1f ms (%s web process)", (g_get_monotonic_time() - d->first_load_start) / 1000.0, warm ? "warm" : "cold");
+}
+
 static void wemed_panel_init(WemedPanel* wp) {
 	GET_D(wp);
 
@@ -288,17 +349,15 @@ static void wemed_panel_init(WemedPanel* wp) {
 	d->headerview = gtk_text_view_new();
 	gtk_text_view_set_monospace(GTK_TEXT_VIEW(d->headerview), TRUE);
 	d->headertext = gtk_text_view_get_buffer(GTK_TEXT_VIEW(d->headerview));
-	d->webkit_ctx = webkit_web_context_new();
-	webkit_web_context_set_cache_model(d->webkit_ctx, WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER);
-	g_signal_connect(d->webkit_ctx, "initialize-web-extensions", G_CALLBACK(initialize_web_extensions), NULL);
-	d->webview = webkit_web_view_new_with_context(d->webkit_ctx);
+	wemed_panel_prewarm();
+	d->webview = webkit_web_view_new_with_related_view(warm_view);
+	g_object_set_data(G_OBJECT(d->webview), "wemed-panel", wp);
 	d->progress_bar = gtk_progress_bar_new();
 	d->open_ext_btn = gtk_button_new();
 	g_signal_connect(d->open_ext_btn, "pressed", G_CALLBACK(openext_cb), wp);
 	d->open_with_ext_btn = gtk_button_new_with_mnemonic(_("Edit _With..."));
 	g_signal_connect(d->open_with_ext_btn, "pressed", G_CALLBACK(openwith_cb), wp);
 
-	webkit_web_context_register_uri_scheme(d->webkit_ctx, "cid", load_cid_cb, wp, NULL);
 	webkit_web_view_set_editable(WEBKIT_WEB_VIEW(d->webview), TRUE);
 	webkit_web_view_evaluate_javascript(WEBKIT_WEB_VIEW(d->webview), "document.execCommand('styleWithCSS',false,true)", -1, NULL, NULL, NULL, NULL, NULL);
 
@@ -310,6 +369,7 @@ static void wemed_panel_init(WemedPanel* wp) {
 	g_signal_connect(G_OBJECT(d->webview), "notify::estimated-load-progress", G_CALLBACK(progress_changed_cb), wp);
 	g_signal_connect(G_OBJECT(d->webview), "show", G_CALLBACK(hide_progress_bar), d->progress_bar);
 	g_signal_connect(G_OBJECT(d->webview), "user-message-received", G_CALLBACK(webext_msg_received), wp);
+	g_signal_connect(G_OBJECT(d->webview), "load-changed", G_CALLBACK(load_changed_cb), wp);
 
 	GtkWidget* toolbar = gtk_toolbar_new();
 	{
@@ -384,23 +444,23 @@ static void wemed_panel_class_init(WemedPanelClass* class) {
 	    G_TYPE_FROM_CLASS ((GObjectClass*)class),
 	    G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
 	    0, // v-table offset
-	    NULL,
+	    g_signal_accumulator_true_handled,
 	    NULL,
 	    NULL, //marshaller
-	    G_TYPE_BYTE_ARRAY, // return tye
-	    1, // num args
-	    G_TYPE_STRING); // arg types
+	    G_TYPE_BOOLEAN, // return tye
+	    2, // num args
+	    G_TYPE_STRING, G_TYPE_POINTER); // arg types
 	wemed_panel_signals[WP_SIG_IMPORT] = g_signal_new(
-	    "import-file",
+	    "import-files",
 	    G_TYPE_FROM_CLASS ((GObjectClass*)class),
 	    G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
-	    0, // v-table offset
+	    0,
 	    NULL,
 	    NULL,
-	    NULL, //marshaller
-	    G_TYPE_STRING, // return tye
-	    1, // num args
-	    G_TYPE_STRING); // arg types
+	    NULL,
+	    G_TYPE_NONE,
+	    1,
+	    G_TYPE_STRV);
 	wemed_panel_signals[WP_SIG_DIRTIED] = g_signal_new(
 	    "dirtied",
 	    G_TYPE_FROM_CLASS ((GObjectClass*)class),
@@ -436,14 +496,19 @@ void wemed_panel_load_doc(WemedPanel* wp, WemedPanelDoc doc) {
 	gtk_text_buffer_set_modified(d->headertext, FALSE);
 
 	gtk_widget_set_sensitive(d->headerview, TRUE);
-	if(doc.content.str && doc.content_type) {
+	if(doc.content && doc.content_type) {
+		gsize content_len;
+		const char* content_str = g_bytes_get_data(doc.content, &content_len);
+		if(content_str == NULL) // GBytes may not have a buffer when empty
+			content_str = "";
 		if(strncmp(doc.content_type, "text/", 5) == 0) {
 			if(strncmp(&doc.content_type[5], "html", 4) == 0 && !d->view_source) {
 				// use webkit widget
-				// Since the content is a string, include the NULL terminator in the GBytes size.
-				// webkit will refuse to load a GBytes with zero length.
+				// webkit will refuse to load a GBytes with zero length, so give it
+				// a lone NULL terminator in that case.
 				// webkit_web_view_load_html is not used since there is no way to set the charset
-				GBytes* bytes = g_bytes_new(doc.content.str, doc.content.len + 1);
+				GBytes* bytes = content_len ? g_bytes_ref(doc.content) : g_bytes_new_static("", 1);
+				note_first_load(d);
 				webkit_web_view_load_bytes(WEBKIT_WEB_VIEW(d->webview), bytes, doc.content_type, doc.charset, NULL);
 				g_bytes_unref(bytes);
 				webkit_web_view_set_editable(WEBKIT_WEB_VIEW(d->webview), TRUE);
@@ -452,11 +517,10 @@ void wemed_panel_load_doc(WemedPanel* wp, WemedPanelDoc doc) {
 				gtk_widget_show(d->progress_bar);
 			} else {
 				// use sourceview widget
-				GString src = doc.content;
 				if(doc.charset && strcasecmp(doc.charset, "utf-8") != 0) {
 					// GtkTextBuffer must be fed utf-8
 					gsize sz;
-					char* converted = g_convert(src.str, src.len, "utf-8", doc.charset, NULL, &sz, NULL);
+					char* converted = g_convert(content_str, content_len, "utf-8", doc.charset, NULL, &sz, NULL);
 					if(converted) {
 						gtk_text_buffer_set_text(d->sourcetext, converted, sz);
 						free(converted);
@@ -464,7 +528,7 @@ void wemed_panel_load_doc(WemedPanel* wp, WemedPanelDoc doc) {
 						fprintf(stderr, "Conversion from %s to utf8 failed\n", doc.charset);
 				} else {
 					// already utf-8
-					gtk_text_buffer_set_text(d->sourcetext, src.str, src.len);
+					gtk_text_buffer_set_text(d->sourcetext, content_str, content_len);
 				}
 				gtk_source_buffer_set_language(GTK_SOURCE_BUFFER(d->sourcetext), gtk_source_language_manager_guess_language(gtk_source_language_manager_get_default(), NULL, doc.content_type));
 				gtk_text_buffer_set_modified(d->sourcetext, FALSE);
@@ -472,9 +536,10 @@ void wemed_panel_load_doc(WemedPanel* wp, WemedPanelDoc doc) {
 			}
 		} else if(webkit_web_view_can_show_mime_type(WEBKIT_WEB_VIEW(d->webview), doc.content_type)) {
 			// load image or other webkit-displayable read-only type
-			GBytes* bytes = g_bytes_new(doc.content.str, doc.content.len);
-			webkit_web_view_load_bytes(WEBKIT_WEB_VIEW(d->webview), bytes, doc.content_type, doc.charset, NULL);
-			g_bytes_unref(bytes);
+			if(content_len) {
+				note_first_load(d);
+				webkit_web_view_load_bytes(WEBKIT_WEB_VIEW(d->webview), doc.content, doc.content_type, doc.charset, NULL);
+			}
 		} else {
 			// unhandled type - offer to open with external app
 			char* label = NULL;
@@ -485,12 +550,34 @@ void wemed_panel_load_doc(WemedPanel* wp, WemedPanelDoc doc) {
 		}
 	}
 
+	// modification is tracked per part, so start from clean
+	wemed_panel_set_clean(wp);
+
 	// set up callbacks to notify when the content is dirtied
 	// for the webview, this is handled by an IPC message
 	g_signal_connect(G_OBJECT(d->headertext), "modified-changed", G_CALLBACK(dirtied_cb), wp);
 	g_signal_connect(G_OBJECT(d->sourcetext), "modified-changed", G_CALLBACK(dirtied_cb), wp);
 }
 
+static gboolean pulse_progress_bar(gpointer user_data) {
+	gtk_progress_bar_pulse(GTK_PROGRESS_BAR(user_data));
+	return G_SOURCE_CONTINUE;
+}
+
+void wemed_panel_show_loading(WemedPanel* wp, GString headers) {
+	GET_D(wp);
+	wemed_panel_clear(wp);
+
+	// the headers are shown straight away but may not be edited until
+	// the content arrives in wemed_panel_load_doc
+	gtk_text_buffer_set_text(d->headertext, headers.str, headers.len);
+	gtk_text_buffer_set_modified(d->headertext, FALSE);
+
+	gtk_progress_bar_pulse(GTK_PROGRESS_BAR(d->progress_bar));
+	gtk_widget_show(d->progress_bar);
+	d->pulse_source = g_timeout_add(100, pulse_progress_bar, d->progress_bar);
+}
+
 void wemed_panel_show_source(WemedPanel* wp, gboolean en) {
 	GET_D(wp);
 	d->view_source = en;
@@ -517,6 +604,10 @@ void wemed_panel_clear(WemedPanel* wp) {
 	gtk_widget_hide(d->webview);
 	gtk_widget_hide(d->toolbar);
 	gtk_widget_hide(d->progress_bar);
+	if(d->pulse_source) {
+		g_source_remove(d->pulse_source);
+		d->pulse_source = 0;
+	}
 	// hide source view
 	gtk_widget_hide(d->sourceview);
 	// hide open with
@@ -532,7 +623,21 @@ void wemed_panel_clear(WemedPanel* wp) {
 void wemed_panel_set_clean(WemedPanel *wp) {
 	GET_D(wp);
 	d->webkit_dirty = FALSE;
+	// the web extension only reports the first edit after this
+	webkit_web_view_send_message_to_page(WEBKIT_WEB_VIEW(d->webview), webkit_user_message_new("set-clean", NULL), NULL, NULL, NULL);
 	// this will trigger modified-changed callbacks but they should do nothing
 	gtk_text_buffer_set_modified(d->sourcetext, FALSE);
 	gtk_text_buffer_set_modified(d->headertext, FALSE);
 }
+
+gboolean wemed_panel_content_modified(WemedPanel* wp) {
+	GET_D(wp);
+	if(gtk_widget_is_visible(d->sourceview))
+		return gtk_text_buffer_get_modified(d->sourcetext);
+	return d->webkit_dirty;
+}
+
+gboolean wemed_panel_headers_modified(WemedPanel* wp) {
+	GET_D(wp);
+	return gtk_text_buffer_get_modified(d->headertext);
+}
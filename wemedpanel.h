@@ -24,17 +24,37 @@ typedef struct {
 	const char* content_type;
 	const char* charset;
 	GString headers;
-	GString content;
+	// decoded content, shared with the model rather than copied
+	GBytes* content;
 	const char* mimeapp_name;
 } WemedPanelDoc;
 
+// Filled in by handlers of cid-requested, which return TRUE if they
+// found the resource. The stream and content type are then owned by the
+// panel
+typedef struct {
+	GInputStream* stream;
+	gint64 length; // -1 if unknown
+	char* content_type; // may be NULL
+} WemedPanelResource;
+
 GType wemed_panel_get_type(void);
 
+// Starts the web process used by all panels, so that the first HTML part
+// doesn't have to wait for it. Called at startup; panels call it too if
+// it hasn't been. With WEMED_NO_PREWARM set in the environment, only the
+// shared context is set up
+void wemed_panel_prewarm(void);
+
 GtkWidget* wemed_panel_new(void);
 
 // Loads a new MIME part into the display pane
 void wemed_panel_load_doc(WemedPanel* wp, WemedPanelDoc doc);
 
+// Shows the headers of a part with a progress indicator while its
+// content is being prepared. Follow up with wemed_panel_load_doc
+void wemed_panel_show_loading(WemedPanel* wp, GString headers);
+
 // Toggle between showing HTML or source
 void wemed_panel_show_source(WemedPanel* wp, gboolean);
 
@@ -47,8 +67,19 @@ void wemed_panel_display_images(WemedPanel* wp, gboolean en);
 // Return the (possibly modified) headers
 GString wemed_panel_get_headers(WemedPanel* wp);
 
-// Return the (possibly modified) text or HTML-source content
-GString wemed_panel_get_content(WemedPanel* wp);
+// Fetch the (possibly modified) text or HTML-source content. The result
+// is utf-8 and must be freed with g_free
+void wemed_panel_get_content_async(WemedPanel* wp, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data);
+GString wemed_panel_get_content_finish(WemedPanel* wp, GAsyncResult* result, GError** error);
+
+// Whether the user has edited the content or headers of the loaded
+// part since it was loaded or last marked clean
+gboolean wemed_panel_content_modified(WemedPanel* wp);
+gboolean wemed_panel_headers_modified(WemedPanel* wp);
+
+// Inserts images, referenced by Content-ID, at the cursor of the HTML
+// editor. Images chosen in the panel are announced with import-files
+void wemed_panel_insert_images(WemedPanel* wp, const char* const* cids);
 
 void wemed_panel_clear(WemedPanel* wp);
 